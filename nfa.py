@@ -524,14 +524,16 @@ class Nfa:
             p = to_merge.pop()
             self.merge_states({q:p for q in to_merge})
 
-    def compute_freq(self, pcap):
+    def compute_freq(self, pcap, workers=None):
         '''
         Call external program for calculating packet frequency for the NFA.
 
         Parameters
         ----------
         pcap :
-            PCAP filename
+            PCAP filename or list of PCAP filenames
+        workers :
+            number of threads, all CPUs by default
 
         Return
         ------
@@ -541,7 +543,10 @@ class Nfa:
         fr_file = tempfile.NamedTemporaryFile()
         with open(fa_file.name, 'w') as f:
             self.print(f)
-        subpr.call(['./state_frequency', fa_file.name, pcap, fr_file.name])
+        pcaps = [pcap] if isinstance(pcap, str) else list(pcap)
+        workers = workers or os.cpu_count() or 1
+        subpr.call(['./state_frequency', '-n', str(workers), fa_file.name] +
+            pcaps + [fr_file.name])
         return self.retrieve_freq(fr_file.name)
 
     def retrieve_freq(self, fname):
@@ -586,7 +591,7 @@ class Nfa:
         target:
             file with the original NFA
         reduced:
-            file with the reduced NFA
+            file with the reduced NFA, or a list of them evaluated in one pass
         pcap: str
             PCAP filenames, separated by spaces
         nw:
@@ -597,6 +602,8 @@ class Nfa:
         string containing the values of evaluation statistics separated by a
         comma
         '''
+        if not isinstance(reduced, str):
+            reduced = ','.join(reduced)
         prog = ' '.join(['./nfa_eval', target, reduced, '-n', str(nw), pcap,
              '-c']).split()
         o = subpr.check_output(prog)
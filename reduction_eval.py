@@ -160,6 +160,7 @@ def reduce_eval(fa_name, *, test, train=None, ratios, merge=False, ths=[.995],
     freq = aut.get_freq(train)
     reduction_csv = []
     eval_csv = []
+    reduced_files = []
 
     for r, th, mf in itertools.product(ratios, ths, mfs):
         a, m = reduce_nfa(deepcopy(aut), freq, r, merge, th, mf)
@@ -191,8 +192,12 @@ def reduce_eval(fa_name, *, test, train=None, ratios, merge=False, ths=[.995],
                 'NA', 'NA', 0, a.state_count, a.trans_count]])
         reduction_csv.append(o)
 
-        # eval error and save result
-        eval_csv.append(Nfa.eval_accuracy(fa_name, reduced, test_data, nw=nw))
+        reduced_files.append(reduced)
+
+    # eval error of all reduced automata in one pass and save result
+    if reduced_files:
+        eval_csv.append(
+            Nfa.eval_accuracy(fa_name, reduced_files, test_data, nw=nw))
 
     with open(ERR_CSV, 'a') as f:
         for i in eval_csv: f.write(i)
@@ -0,0 +1,344 @@
+/// @author Jakub Semric
+/// 2018
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <stdexcept>
+#include <cstdio>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "nfa.hpp"
+#include "lazy_dfa.hpp"
+#include "pcap_reader.hpp"
+
+using namespace reduction;
+using namespace std;
+
+const char *helpstr =
+"Usage: ./nfa_bench [OPTIONS] PCAP NFA...\n"
+"Benchmark reading of PCAP, loading of automata in the .fa format and their\n"
+"simulation engines over payloads of PCAP held in memory. Throughput is given\n"
+"in MB of payload and in packets per second, the best of repeated runs is\n"
+"reported. Results are written in JSON.\n"
+"\noptions:\n"
+"  -h            : show this help and exit\n"
+"  -o <FILE>     : JSON output file, default standard output\n"
+"  -r <N>        : number of runs of each benchmark, default 3\n"
+"  -l <MB>       : lazy DFA cache size, default 64\n";
+
+/// Max. number of payloads read at once.
+const size_t batch_size = 64;
+/// Results of simulations are stored here, so that they are not optimized
+/// out.
+volatile size_t bench_sink;
+
+/// Result of one benchmark.
+struct Measurement
+{
+    string name;
+    double seconds;
+    size_t packets;
+    size_t bytes;
+};
+
+/// Payloads of PCAP file copied to memory.
+struct Payloads
+{
+    vector<unsigned char> data;
+    vector<size_t> offsets;
+    vector<const unsigned char*> words;
+    vector<unsigned> lengths;
+
+    size_t size() const { return lengths.size();}
+};
+
+/// @return the best time of the given number of runs of func in seconds
+template<typename F>
+double best_time(unsigned runs, F func)
+{
+    double best = 0;
+    for (unsigned i = 0; i < runs; i++) {
+        auto start = chrono::steady_clock::now();
+        func();
+        double t = chrono::duration<double>(
+            chrono::steady_clock::now() - start).count();
+        if (i == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+Payloads read_payloads(const string &pcap)
+{
+    Payloads p;
+    pcapreader::process_payload_mmap(
+        pcap.c_str(),
+        [&p] (const unsigned char *payload, unsigned len)
+        {
+            p.offsets.push_back(p.data.size());
+            p.lengths.push_back(len);
+            p.data.insert(p.data.end(), payload, payload + len);
+        });
+
+    for (auto i : p.offsets)
+        p.words.push_back(p.data.data() + i);
+    return p;
+}
+
+/// Reading of payloads from PCAP file by the readers of pcap_reader.hpp.
+vector<Measurement> bench_ingestion(const string &pcap, unsigned runs)
+{
+    vector<Measurement> res;
+    size_t packets, bytes;
+    auto count = [&] (const pcapreader::PayloadBatch &batch) {
+        packets += batch.size();
+        for (auto i : batch.lengths)
+            bytes += i;
+    };
+
+    double t = best_time(runs, [&] () {
+        packets = bytes = 0;
+        pcapreader::process_payload_mmap_batch(
+            pcap.c_str(), count, batch_size);
+    });
+    res.push_back(Measurement{"mmap", t, packets, bytes});
+
+    t = best_time(runs, [&] () {
+        packets = bytes = 0;
+        auto p = pcapreader::process_payload_batch(
+            pcap.c_str(), count, batch_size);
+        if (p)
+            pcap_close(p);
+    });
+    res.push_back(Measurement{"libpcap", t, packets, bytes});
+
+    t = best_time(runs, [&] () {
+        packets = bytes = 0;
+        pcapreader::ChunkReader reader(pcap.c_str());
+        for (auto &i : pcapreader::index_pcap(pcap.c_str(), 4096)) {
+            pcapreader::process_payload_chunk_batch(
+                reader, i, count, batch_size);
+        }
+    });
+    res.push_back(Measurement{"chunks", t, packets, bytes});
+
+    return res;
+}
+
+/// Parsing of the .fa format, compilation and loading of compiled image.
+vector<Measurement> bench_load(const string &fname, unsigned runs)
+{
+    vector<Measurement> res;
+    double t = best_time(runs, [&] () { Nfa::read_from_file(fname);});
+    res.push_back(Measurement{"read_from_file", t, 0, 0});
+
+    Nfa nfa = Nfa::read_from_file(fname);
+    t = best_time(runs, [&] () { NfaArray arr(nfa);});
+    res.push_back(Measurement{"compile", t, 0, 0});
+
+    char tmp[] = "/tmp/nfa_bench.XXXXXX";
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+        throw runtime_error("cannot create temporary file");
+    close(fd);
+    try {
+        NfaArray(nfa).write(tmp);
+        t = best_time(runs, [&] () { NfaArray::load(tmp);});
+    }
+    catch (...) {
+        remove(tmp);
+        throw;
+    }
+    remove(tmp);
+    res.push_back(Measurement{"load_image", t, 0, 0});
+
+    return res;
+}
+
+/// Simulation of the automaton by ScanContext and LazyDfa.
+vector<Measurement> bench_matching(
+    const NfaArray &nfa, const Payloads &p, unsigned runs,
+    size_t lazy_dfa_mem)
+{
+    vector<Measurement> res;
+    size_t bytes = p.data.size();
+    size_t sink = 0;
+    string engine = nfa.uses_bitset() ? "bitset" : "sparse";
+    ScanContext ctx(nfa);
+    StateFreq freq(nfa.state_count());
+
+    double t = best_time(runs, [&] () {
+        for (size_t i = 0; i < p.size(); i++)
+            ctx.parse_word(p.words[i], p.lengths[i], [&](StateIdx) {sink++;});
+    });
+    res.push_back(Measurement{engine + ".parse_word", t, p.size(), bytes});
+
+    t = best_time(runs, [&] () {
+        for (size_t i = 0; i < p.size(); i++)
+            sink += ctx.accept(p.words[i], p.lengths[i]);
+    });
+    res.push_back(Measurement{engine + ".accept", t, p.size(), bytes});
+
+    t = best_time(runs, [&] () {
+        for (size_t i = 0; i < p.size(); i++)
+            ctx.label_states(freq, p.words[i], p.lengths[i]);
+    });
+    res.push_back(Measurement{engine + ".label_states", t, p.size(), bytes});
+
+    LazyDfa dfa(nfa, lazy_dfa_mem);
+    bool accepted[LazyDfa::batch_size];
+    t = best_time(runs, [&] () {
+        for (size_t i = 0; i < p.size(); i += LazyDfa::batch_size) {
+            size_t n = min(p.size() - i, LazyDfa::batch_size);
+            dfa.accept_batch(
+                p.words.data() + i, p.lengths.data() + i, n, accepted);
+            sink += accepted[0];
+        }
+    });
+    res.push_back(Measurement{"lazy_dfa.accept_batch", t, p.size(), bytes});
+
+    t = best_time(runs, [&] () {
+        for (size_t i = 0; i < p.size(); i += LazyDfa::batch_size) {
+            dfa.label_states_batch(
+                freq, p.words.data() + i, p.lengths.data() + i,
+                min(p.size() - i, LazyDfa::batch_size));
+        }
+    });
+    res.push_back(
+        Measurement{"lazy_dfa.label_states_batch", t, p.size(), bytes});
+
+    bench_sink = sink;
+    return res;
+}
+
+string json_str(const string &s)
+{
+    string res = "\"";
+    for (auto c : s) {
+        if (c == '"' || c == '\\')
+            res += '\\';
+        res += c;
+    }
+    return res + "\"";
+}
+
+void write_measurements(
+    ostream &out, const vector<Measurement> &m, const string &indent)
+{
+    out << "[";
+    for (size_t i = 0; i < m.size(); i++) {
+        out << (i ? "," : "") << "\n" << indent << "  {\"name\": "
+            << json_str(m[i].name) << ", \"seconds\": " << m[i].seconds;
+        if (m[i].packets) {
+            out << ", \"mb_per_s\": " << m[i].bytes / m[i].seconds / 1e6
+                << ", \"packets_per_s\": " << m[i].packets / m[i].seconds;
+        }
+        out << "}";
+    }
+    out << "\n" << indent << "]";
+}
+
+/// Prints throughput of benchmarks in a human readable form.
+void print_measurements(ostream &out, const vector<Measurement> &m)
+{
+    for (auto &i : m) {
+        out << "  " << i.name
+            << string(28 - min<size_t>(27, i.name.size()), ' ');
+        if (i.packets) {
+            out << i.bytes / i.seconds / 1e6 << " MB/s, "
+                << i.packets / i.seconds << " packets/s";
+        }
+        else {
+            out << i.seconds * 1000 << " ms";
+        }
+        out << endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    string outfile;
+    unsigned runs = 3;
+    size_t lazy_dfa_mem = 64;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "ho:r:l:")) != -1) {
+            switch (c) {
+                case 'h':
+                    cerr << helpstr;
+                    return 0;
+                case 'o':
+                    outfile = optarg;
+                    break;
+                case 'r':
+                    runs = max(1UL, stoul(optarg));
+                    break;
+                case 'l':
+                    lazy_dfa_mem = stoul(optarg);
+                    break;
+                default:
+                    return 1;
+            }
+        }
+
+        if (argc - optind < 2)
+            throw runtime_error("PCAP and at least one NFA required");
+
+        string pcap = argv[optind];
+        Payloads payloads = read_payloads(pcap);
+        ostringstream json;
+        json.precision(6);
+
+        cerr << "ingestion of " << pcap << endl;
+        auto ingestion = bench_ingestion(pcap, runs);
+        print_measurements(cerr, ingestion);
+        json << "{\n  \"pcap\": " << json_str(pcap) << ",\n  \"packets\": "
+            << payloads.size() << ",\n  \"bytes\": " << payloads.data.size()
+            << ",\n  \"runs\": " << runs << ",\n  \"ingestion\": ";
+        write_measurements(json, ingestion, "  ");
+        json << ",\n  \"automata\": [";
+
+        for (int i = optind + 1; i < argc; i++) {
+            string fname = argv[i];
+            cerr << fname << endl;
+            auto load = bench_load(fname, runs);
+            NfaArray nfa(Nfa::read_from_file(fname));
+            auto matching = bench_matching(nfa, payloads, runs, lazy_dfa_mem);
+            print_measurements(cerr, load);
+            print_measurements(cerr, matching);
+
+            json << (i > optind + 1 ? "," : "") << "\n    {\n"
+                << "      \"nfa\": " << json_str(fname) << ",\n"
+                << "      \"states\": " << nfa.state_count() << ",\n"
+                << "      \"transitions\": " << nfa.trans_count() << ",\n"
+                << "      \"load\": ";
+            write_measurements(json, load, "      ");
+            json << ",\n      \"matching\": ";
+            write_measurements(json, matching, "      ");
+            json << "\n    }";
+        }
+        json << "\n  ]\n}\n";
+
+        if (outfile != "") {
+            ofstream out{outfile};
+            if (!out.is_open())
+                throw runtime_error("cannot open output file");
+            out << json.str();
+        }
+        else {
+            cout << json.str();
+        }
+    }
+    catch (exception &e) {
+        cerr << "\033[1;31mERROR\033[0m " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,278 @@
+/// @author Jakub Semric
+/// 2018
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <stdexcept>
+#include <deque>
+#include <cstring>
+#include <getopt.h>
+
+#include "nfa.hpp"
+
+using namespace reduction;
+using namespace std;
+
+const char *helpstr =
+"Usage: ./pcap_gen [OPTIONS] OUTPUT [NFA...]\n"
+"Generate a synthetic PCAP file of TCP packets with random payloads, a part\n"
+"of the payloads contains strings accepted by the given automata.\n"
+"\noptions:\n"
+"  -h            : show this help and exit\n"
+"  -n <N>        : number of packets, default 20000\n"
+"  -d <DIST>     : distribution of payload lengths, fixed:N, uniform:MIN:MAX\n"
+"                  or exp:MEAN, default exp:400, lengths are at most 1460\n"
+"  -m <FRAC>     : fraction of payloads seeded with an accepted string,\n"
+"                  default 0.1\n"
+"  -s <SEED>     : seed of the random generator, default 1\n";
+
+/// Max. payload length of one Ethernet frame.
+const unsigned max_payload = 1460;
+/// Number of accepted strings generated per automaton.
+const unsigned seed_count = 64;
+/// Ethernet, IPv4 and TCP headers.
+const unsigned header_size = 14 + 20 + 20;
+
+/// Random payload length according to the distribution given by -d.
+class LengthDist
+{
+private:
+    string kind;
+    unsigned a, b;
+
+public:
+    LengthDist(const string &spec)
+    {
+        auto colon = spec.find(':');
+        kind = spec.substr(0, colon);
+        string args = colon == string::npos ? "" : spec.substr(colon + 1);
+        auto colon2 = args.find(':');
+        try {
+            a = stoul(args.substr(0, colon2));
+            b = colon2 == string::npos ? a : stoul(args.substr(colon2 + 1));
+        }
+        catch (exception &) {
+            throw runtime_error("invalid length distribution '" + spec + "'");
+        }
+
+        if ((kind != "fixed" && kind != "uniform" && kind != "exp") ||
+            a > b || (kind == "exp" && a == 0))
+        {
+            throw runtime_error("invalid length distribution '" + spec + "'");
+        }
+    }
+
+    unsigned operator()(mt19937_64 &gen) const
+    {
+        unsigned len = a;
+        if (kind == "uniform")
+            len = uniform_int_distribution<unsigned>(a, b)(gen);
+        else if (kind == "exp")
+            len = exponential_distribution<double>(1.0 / a)(gen);
+        return max(1U, min(len, max_payload));
+    }
+};
+
+/// Generates strings accepted by the automaton by random walks from the
+/// initial state, which always move closer to some final state.
+vector<string> accepted_strings(
+    const NfaArray &nfa, unsigned count, mt19937_64 &gen)
+{
+    size_t n = nfa.state_count();
+    unsigned classes = nfa.get_class_count();
+    vector<vector<Symbol>> symbols(classes);
+    for (unsigned c = 0; c < 256; c++)
+        symbols[nfa.get_symbol_class(c)].push_back(c);
+
+    // distance of each state to the nearest final state
+    vector<vector<StateIdx>> pred(n);
+    for (StateIdx s = 0; s < n; s++) {
+        for (unsigned c = 0; c < classes; c++) {
+            for (auto t = nfa.succ_begin(s, c); t != nfa.succ_end(s, c); t++)
+                pred[*t].push_back(s);
+        }
+    }
+
+    const unsigned inf = ~0U;
+    vector<unsigned> dist(n, inf);
+    deque<StateIdx> queue;
+    for (StateIdx s = 0; s < n; s++) {
+        if (nfa.is_final_idx(s)) {
+            dist[s] = 0;
+            queue.push_back(s);
+        }
+    }
+    while (!queue.empty()) {
+        StateIdx s = queue.front();
+        queue.pop_front();
+        for (auto p : pred[s]) {
+            if (dist[p] == inf) {
+                dist[p] = dist[s] + 1;
+                queue.push_back(p);
+            }
+        }
+    }
+
+    vector<string> res;
+    StateIdx init = nfa.get_initial_state_idx();
+    if (dist[init] == inf)
+        return res;
+
+    for (unsigned i = 0; i < count; i++) {
+        string str;
+        StateIdx s = init;
+        while (dist[s]) {
+            vector<pair<unsigned,StateIdx>> next;
+            for (unsigned c = 0; c < classes; c++) {
+                for (auto t = nfa.succ_begin(s, c); t != nfa.succ_end(s, c);
+                    t++)
+                {
+                    if (dist[*t] + 1 == dist[s])
+                        next.push_back(make_pair(c, *t));
+                }
+            }
+
+            auto &step = next[
+                uniform_int_distribution<size_t>(0, next.size() - 1)(gen)];
+            auto &sym = symbols[step.first];
+            str.push_back(
+                sym[uniform_int_distribution<size_t>(0, sym.size() - 1)(gen)]);
+            s = step.second;
+        }
+        res.push_back(str);
+    }
+
+    return res;
+}
+
+/// Writes a packet with Ethernet, IPv4 and TCP headers.
+void write_packet(
+    ostream &out, const string &payload, uint32_t ts, uint32_t seq)
+{
+    unsigned char hdr[header_size] = {};
+    // Ethernet, IPv4
+    hdr[12] = 0x08;
+    hdr[14] = 0x45;
+    uint16_t ip_len = 40 + payload.size();
+    hdr[16] = ip_len >> 8;
+    hdr[17] = ip_len & 0xff;
+    hdr[22] = 64;
+    hdr[23] = 6;
+    uint8_t addr[8] = {10, 0, 0, 1, 10, 0, 0, 2};
+    memcpy(hdr + 26, addr, sizeof(addr));
+    // TCP, port 110 (POP3) to port 1024
+    hdr[34] = 0;
+    hdr[35] = 110;
+    hdr[36] = 4;
+    hdr[37] = 0;
+    for (unsigned i = 0; i < 4; i++)
+        hdr[38 + i] = seq >> (24 - 8 * i);
+    hdr[46] = 5 << 4;
+    hdr[47] = 0x18;
+
+    uint32_t rec[4] = {
+        ts, 0, static_cast<uint32_t>(header_size + payload.size()),
+        static_cast<uint32_t>(header_size + payload.size())};
+    out.write(reinterpret_cast<const char*>(rec), sizeof(rec));
+    out.write(reinterpret_cast<const char*>(hdr), sizeof(hdr));
+    out.write(payload.data(), payload.size());
+}
+
+int main(int argc, char **argv)
+{
+    size_t packets = 20000;
+    string dist_spec = "exp:400";
+    double match_frac = .1;
+    unsigned long seed = 1;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "hn:d:m:s:")) != -1) {
+            switch (c) {
+                case 'h':
+                    cerr << helpstr;
+                    return 0;
+                case 'n':
+                    packets = stoul(optarg);
+                    break;
+                case 'd':
+                    dist_spec = optarg;
+                    break;
+                case 'm':
+                    match_frac = stod(optarg);
+                    break;
+                case 's':
+                    seed = stoul(optarg);
+                    break;
+                default:
+                    return 1;
+            }
+        }
+
+        if (argc - optind < 1)
+            throw runtime_error("OUTPUT required");
+        if (match_frac < 0 || match_frac > 1)
+            throw runtime_error("invalid fraction of seeded payloads");
+
+        LengthDist dist(dist_spec);
+        mt19937_64 gen(seed);
+        vector<string> seeds;
+        for (int i = optind + 1; i < argc; i++) {
+            NfaArray nfa(Nfa::read_from_file(argv[i]));
+            auto s = accepted_strings(nfa, seed_count, gen);
+            if (s.empty())
+                cerr << "no string accepted by " << argv[i] << endl;
+            seeds.insert(seeds.end(), s.begin(), s.end());
+        }
+
+        ofstream out{argv[optind], ios::binary};
+        if (!out.is_open())
+            throw runtime_error("cannot open output file");
+
+        // classic PCAP, microseconds, Ethernet
+        uint32_t global_hdr[6] = {0xa1b2c3d4, 0x00040002, 0, 0, 65535, 1};
+        out.write(reinterpret_cast<const char*>(global_hdr),
+            sizeof(global_hdr));
+
+        // mostly printable bytes, as in text protocols
+        uniform_int_distribution<int> byte(32, 126);
+        bernoulli_distribution seeded(seeds.empty() ? 0 : match_frac);
+        size_t nseeded = 0, bytes = 0;
+        uint32_t seq = 0;
+        for (size_t i = 0; i < packets; i++) {
+            string payload(dist(gen), ' ');
+            for (auto &ch : payload)
+                ch = byte(gen);
+
+            if (seeded(gen)) {
+                // the automata are simulated from the beginning of payloads,
+                // so the string is not preceded by random bytes
+                auto &s = seeds[
+                    uniform_int_distribution<size_t>(0, seeds.size() - 1)(gen)];
+                payload.replace(0, min(s.size(), payload.size()), s);
+                nseeded++;
+            }
+
+            write_packet(out, payload, i / 1000, seq);
+            seq += payload.size();
+            bytes += payload.size();
+        }
+
+        out.close();
+        if (!out)
+            throw runtime_error("cannot write output file");
+
+        cerr << "packets   : " << packets << endl;
+        cerr << "seeded    : " << nseeded << endl;
+        cerr << "bytes     : " << bytes << endl;
+    }
+    catch (exception &e) {
+        cerr << "\033[1;31mERROR\033[0m " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
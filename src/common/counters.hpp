@@ -0,0 +1,55 @@
+/// @author Jakub Semric
+/// 2018
+
+#pragma once
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+namespace reduction
+{
+
+using namespace std;
+
+/// Allocator of arrays, which start at a cache line boundary and are
+/// rounded up to whole cache lines, so that arrays of different threads
+/// never share a cache line.
+template<typename T>
+struct CacheLineAllocator
+{
+    typedef T value_type;
+    static const size_t line = 64;
+
+    CacheLineAllocator() = default;
+    template<typename U>
+    CacheLineAllocator(const CacheLineAllocator<U> &) {}
+
+    T *allocate(size_t n)
+    {
+        void *p;
+        if (posix_memalign(&p, line, (n * sizeof(T) + line - 1) / line * line))
+            throw bad_alloc();
+        return static_cast<T*>(p);
+    }
+
+    void deallocate(T *p, size_t) { free(p);}
+};
+
+template<typename T, typename U>
+bool operator==(const CacheLineAllocator<T> &, const CacheLineAllocator<U> &)
+{
+    return true;
+}
+
+template<typename T, typename U>
+bool operator!=(const CacheLineAllocator<T> &, const CacheLineAllocator<U> &)
+{
+    return false;
+}
+
+/// packet frequency of states by state index, each counting thread has its
+/// own array
+using StateFreq = vector<size_t, CacheLineAllocator<size_t>>;
+
+}
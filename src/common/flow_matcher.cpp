@@ -0,0 +1,80 @@
+/// @author Jakub Semric
+/// 2018
+
+#include <algorithm>
+
+#include "flow_matcher.hpp"
+
+namespace reduction
+{
+
+const size_t FlowMatcher::flow_overhead;
+const size_t FlowMatcher::default_mem_limit;
+const unsigned FlowMatcher::default_idle_timeout;
+
+FlowMatcher::FlowMatcher(
+    const NfaArray &nfa, size_t mem_limit, double idle_timeout) :
+    nfa{nfa}, ctx{nfa}, mem_limit{mem_limit << 20}, mem_used{0},
+    idle_timeout{idle_timeout}, mark(nfa.state_count()), segment{0}
+{
+}
+
+/// Removes flow from the table.
+void FlowMatcher::remove_flow(FlowTable::iterator it)
+{
+    mem_used -= flow_mem(it->second);
+    lru.erase(it->second.lru);
+    flows.erase(it);
+}
+
+/// Evicts flows idle for the timeout and the least recently used flows if
+/// the memory limit is exceeded.
+/// @param now time of the last packet
+void FlowMatcher::evict(double now)
+{
+    while (!lru.empty() && lru.back()->second.last_seen + idle_timeout < now)
+    {
+        counters.idle++;
+        remove_flow(lru.back());
+    }
+
+    while (!lru.empty() && mem_used > mem_limit) {
+        counters.evicted++;
+        remove_flow(lru.back());
+    }
+}
+
+/// Computes packet frequency of states like ScanContext::label_states, but the
+/// segment is parsed as a part of its flow.
+/// @param state_freq frequency of each state
+/// @param info header fields of the packet
+/// @param payload packet payload
+/// @param len payload length
+/// @param accepted if 0 or 1, count only segments which reach (1) or do not
+/// reach (0) a final state
+void FlowMatcher::label_states(
+    StateFreq &state_freq, const pcapreader::PacketInfo &info,
+    const unsigned char *payload, unsigned len, int accepted)
+{
+    bool final = false;
+    segment++;
+    visited.clear();
+    parse_segment(
+        info, payload, len,
+        [&](StateIdx s) {
+            if (mark[s] != segment) {
+                mark[s] = segment;
+                visited.push_back(s);
+                final |= nfa.is_final_idx(s);
+            }
+        });
+
+    if (len == 0 || (accepted >= 0 && final != (accepted == 1)))
+        return;
+
+    for (auto s : visited)
+        state_freq[s]++;
+    state_freq[nfa.get_initial_state_idx()]++;
+}
+
+}
@@ -0,0 +1,179 @@
+/// @author Jakub Semric
+/// 2018
+
+#pragma once
+
+#include <iostream>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "nfa.hpp"
+#include "pcap_reader.hpp"
+
+namespace reduction
+{
+
+using namespace std;
+
+/// Counters of the flow table.
+struct FlowCounters
+{
+    size_t resumed;     // segments continuing the simulation of their flow
+    size_t restarted;   // segments starting from the initial state
+    size_t closed;      // flows closed by FIN or RST
+    size_t idle;        // flows evicted after idle timeout
+    size_t evicted;     // flows evicted due to memory limit
+    size_t max_flows;   // max. number of flows in the table
+    size_t max_mem;     // max. memory of the table in bytes
+
+    FlowCounters() :
+        resumed{0}, restarted{0}, closed{0}, idle{0}, evicted{0},
+        max_flows{0}, max_mem{0} {}
+
+    void print(ostream &out = cerr) const
+    {
+        out << "resumed   : " << resumed << endl;
+        out << "restarted : " << restarted << endl;
+        out << "closed    : " << closed << endl;
+        out << "idle      : " << idle << endl;
+        out << "evicted   : " << evicted << endl;
+        out << "max flows : " << max_flows << endl;
+        out << "max mem   : " << max_mem << " B" << endl;
+    }
+};
+
+/// Simulates NFA over TCP streams in one pass without buffering payloads.
+/// Active states of each flow are stored in a flow table and the simulation
+/// resumes from them on the next in-order segment. Memory of the table is
+/// bounded, least recently used flows are evicted, as well as flows idle for
+/// a long time. Other packets than TCP are simulated independently.
+class FlowMatcher
+{
+private:
+    struct Flow;
+    typedef unordered_map<
+        pcapreader::FlowKey, Flow, pcapreader::FlowKeyHash> FlowTable;
+
+    struct Flow
+    {
+        vector<StateIdx> active;
+        uint32_t next_seq;
+        double last_seen;
+        /// position in the list of flows ordered by last_seen
+        list<FlowTable::iterator>::iterator lru;
+    };
+
+    const NfaArray &nfa;
+    ScanContext ctx;
+    size_t mem_limit;
+    size_t mem_used;
+    double idle_timeout;
+    FlowTable flows;
+    /// the most recently seen flows first
+    list<FlowTable::iterator> lru;
+    /// active states of packets which are not part of a stream
+    vector<StateIdx> packet_active;
+    /// a state has been visited by the segment if its mark equals to
+    /// the segment number
+    vector<size_t> mark;
+    size_t segment;
+    vector<StateIdx> visited;
+    FlowCounters counters;
+
+    /// estimate of memory of a flow besides its active states
+    static const size_t flow_overhead = 160;
+
+    size_t flow_mem(const Flow &flow) const
+    {
+        return flow_overhead + flow.active.capacity() * sizeof(StateIdx);
+    }
+
+    void remove_flow(FlowTable::iterator it);
+    void evict(double now);
+
+public:
+    /// default memory limit of the flow table in MB
+    static const size_t default_mem_limit = 64;
+    /// default idle timeout in seconds
+    static const unsigned default_idle_timeout = 120;
+
+    /// @param nfa simulated automaton
+    /// @param mem_limit max. memory of the flow table in MB
+    /// @param idle_timeout flows idle for the timeout in seconds are evicted
+    FlowMatcher(
+        const NfaArray &nfa, size_t mem_limit = default_mem_limit,
+        double idle_timeout = default_idle_timeout);
+
+    template<typename FuncType>
+    void parse_segment(
+        const pcapreader::PacketInfo &info, const unsigned char *payload,
+        unsigned len, FuncType visited_state_handler);
+
+    void label_states(
+        StateFreq &state_freq, const pcapreader::PacketInfo &info,
+        const unsigned char *payload, unsigned len, int accepted = -1);
+
+    size_t flow_count() const { return flows.size();}
+    size_t mem_usage() const { return mem_used;}
+    const FlowCounters &get_counters() const { return counters;}
+};
+
+/// Parses a segment of a flow. If the segment follows the last segment of
+/// the flow, the simulation continues from the states active after it,
+/// otherwise it starts from the initial state.
+/// @param info header fields of the packet
+/// @param payload packet payload
+/// @param len payload length, 0 for packets opening or closing connection
+/// @param visited_state_handler function which is called after a state has
+/// been visited, at most once per state and byte
+template<typename FuncType>
+void FlowMatcher::parse_segment(
+    const pcapreader::PacketInfo &info, const unsigned char *payload,
+    unsigned len, FuncType visited_state_handler)
+{
+    StateIdx init = nfa.get_initial_state_idx();
+    // TCP segments may carry no flags, so the protocol tells them apart
+    if (info.flow.proto != IPPROTO_TCP) {
+        packet_active.assign(1, init);
+        ctx.parse_word_from(
+            packet_active, payload, len, visited_state_handler);
+        return;
+    }
+
+    auto it = flows.find(info.flow);
+    if (it != flows.end()) {
+        mem_used -= flow_mem(it->second);
+        lru.erase(it->second.lru);
+    }
+    else {
+        it = flows.emplace(info.flow, Flow()).first;
+        it->second.next_seq = info.seq;
+    }
+
+    auto &flow = it->second;
+    if (flow.next_seq == info.seq && !flow.active.empty()) {
+        counters.resumed += len > 0;
+    }
+    else {
+        flow.active.assign(1, init);
+        counters.restarted += len > 0;
+    }
+
+    ctx.parse_word_from(flow.active, payload, len, visited_state_handler);
+    flow.next_seq = info.seq + len + ((info.tcp_flags & TH_SYN) != 0);
+    flow.last_seen = info.time;
+    flow.lru = lru.insert(lru.begin(), it);
+    mem_used += flow_mem(flow);
+
+    if (info.tcp_flags & (TH_FIN | TH_RST)) {
+        counters.closed++;
+        remove_flow(it);
+    }
+
+    counters.max_flows = max(counters.max_flows, flows.size());
+    counters.max_mem = max(counters.max_mem, mem_used);
+    evict(info.time);
+}
+
+}
@@ -0,0 +1,285 @@
+/// @author Jakub Semric
+/// 2018
+
+#include <iostream>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cassert>
+
+#include "lazy_dfa.hpp"
+
+using namespace reduction;
+using namespace std;
+
+const uint32_t LazyDfa::unknown;
+const size_t LazyDfa::batch_size;
+
+/// approximate memory overhead of one DFA state except the successor table
+static const size_t state_overhead = 128;
+
+void LazyDfaCounters::print(ostream &out) const
+{
+    out << "dfa hits  : " << hits << endl;
+    out << "dfa miss  : " << misses << endl;
+    out << "dfa flush : " << flushes << endl;
+    out << "dfa states: " << states << endl;
+}
+
+/// @param nfa automaton to be determinized, has to outlive LazyDfa
+/// @param mem_limit_mb max. size of the cache in MB
+LazyDfa::LazyDfa(const NfaArray &nfa, size_t mem_limit_mb) :
+    nfa(nfa), class_count{nfa.get_class_count()},
+    mem_limit{mem_limit_mb << 20}, mem_used{0},
+    nfa_stamp(nfa.state_count()), nfa_epoch{0},
+    word_cnt{0}, freq_stamp(nfa.state_count()), freq_epoch{0}
+{
+    for (unsigned i = 0; i < 256; i++) {
+        symbol_class[i] = nfa.get_symbol_class(i);
+    }
+    flush();
+    counters.flushes = 0;
+}
+
+/// Inserts a new DFA state with no successors computed yet.
+/// @param set sorted set of NFA states
+/// @return index of the new DFA state
+uint32_t LazyDfa::add_state(const vector<StateIdx> &set)
+{
+    assert(index.find(set) == index.end());
+    uint32_t state = sets.size();
+    auto it = index.emplace(set, state).first;
+    sets.push_back(&it->first);
+    table.resize(table.size() + class_count, unknown);
+    visit_stamp.resize(visit_stamp.size() + batch_size);
+
+    bool fin = false;
+    for (auto i : set)
+        fin |= nfa.is_final_idx(i);
+    accepting.push_back(fin);
+
+    mem_used += (class_count + batch_size) * sizeof(uint32_t) +
+        set.size() * sizeof(StateIdx) + state_overhead;
+    counters.states++;
+    return state;
+}
+
+/// Computes the successor of DFA state over a symbol class using subset
+/// construction and stores it to the cache.
+/// @return the successor, or unknown if the cache is full
+uint32_t LazyDfa::compute_next(uint32_t state, unsigned cls)
+{
+    counters.misses++;
+    if (++nfa_epoch == 0) {
+        fill(nfa_stamp.begin(), nfa_stamp.end(), 0);
+        nfa_epoch = 1;
+    }
+
+    pending.clear();
+    for (auto i : *sets[state]) {
+        for (auto it = nfa.succ_begin(i, cls); it != nfa.succ_end(i, cls);
+             it++)
+        {
+            if (nfa_stamp[*it] != nfa_epoch) {
+                nfa_stamp[*it] = nfa_epoch;
+                pending.push_back(*it);
+            }
+        }
+    }
+    sort(pending.begin(), pending.end());
+
+    uint32_t next;
+    auto it = index.find(pending);
+    if (it != index.end()) {
+        next = it->second;
+    }
+    else {
+        size_t cost = (class_count + batch_size) * sizeof(uint32_t) +
+            pending.size() * sizeof(StateIdx) + state_overhead;
+        // keep at least a few states, otherwise the cache is useless
+        if (mem_used + cost > mem_limit && sets.size() > 2) {
+            return unknown;
+        }
+        next = add_state(pending);
+    }
+
+    table[state * class_count + cls] = next;
+    return next;
+}
+
+/// @param set sorted set of NFA states
+/// @return DFA state of the set, which is inserted if not present
+uint32_t LazyDfa::find_or_add(const vector<StateIdx> &set)
+{
+    auto it = index.find(set);
+    if (it != index.end()) {
+        return it->second;
+    }
+    return add_state(set);
+}
+
+/// Flushes the cache and inserts the pending set of states.
+/// @return DFA state of the pending set
+uint32_t LazyDfa::flush_and_add_pending()
+{
+    flush();
+    return find_or_add(pending);
+}
+
+/// Flushes the cache while a batch of words is being parsed. NFA states of
+/// DFA states visited so far are saved and current states of words in
+/// flight are inserted again.
+/// @param states current DFA state of each word, updated in place
+/// @param lanes indexes of words in flight
+/// @param nlanes number of words in flight
+/// @param nwords number of words in the batch
+/// @return DFA state of the pending set
+uint32_t LazyDfa::flush_batch(
+    uint32_t *states, const size_t *lanes, size_t nlanes, size_t nwords)
+{
+    for (size_t i = 0; i < nwords; i++) {
+        for (auto j : lane_visited[i]) {
+            lane_flushed[i].insert(
+                lane_flushed[i].end(), sets[j]->begin(), sets[j]->end());
+        }
+        lane_visited[i].clear();
+    }
+
+    vector<vector<StateIdx>> keep;
+    for (size_t i = 0; i < nlanes; i++) {
+        keep.push_back(*sets[states[lanes[i]]]);
+    }
+
+    flush();
+    for (size_t i = 0; i < nlanes; i++) {
+        states[lanes[i]] = find_or_add(keep[i]);
+    }
+    return find_or_add(pending);
+}
+
+/// Removes all DFA states except initial and dead state.
+void LazyDfa::flush()
+{
+    counters.flushes++;
+    index.clear();
+    sets.clear();
+    table.clear();
+    accepting.clear();
+    visit_stamp.clear();
+    mem_used = 0;
+
+    init_state = add_state(
+        vector<StateIdx>{static_cast<StateIdx>(nfa.get_initial_state_idx())});
+    dead_state = add_state(vector<StateIdx>{});
+}
+
+/// Decides which words of a batch are accepted, words are parsed in
+/// lock-step as in parse_batch.
+/// @param words packet payloads or strings
+/// @param lengths number of bytes of each word
+/// @param nwords number of words, at most batch_size
+/// @param accepted set to true for accepted words, false otherwise
+void LazyDfa::accept_batch(
+    const Word *words, const unsigned *lengths, size_t nwords,
+    bool *accepted)
+{
+    assert(nwords <= batch_size);
+    uint32_t states[batch_size];
+    unsigned pos[batch_size];
+    size_t active[batch_size];
+    size_t nactive = 0;
+
+    for (size_t i = 0; i < nwords; i++) {
+        states[i] = init_state;
+        pos[i] = 0;
+        accepted[i] = false;
+        if (lengths[i])
+            active[nactive++] = i;
+    }
+
+    while (nactive) {
+        size_t remaining = 0;
+        for (size_t i = 0; i < nactive; i++) {
+            size_t lane = active[i];
+            uint32_t state = next_state(states[lane], words[lane][pos[lane]]);
+            if (state == unknown) {
+                size_t inflight[batch_size];
+                size_t n = 0;
+                for (size_t j = 0; j < remaining; j++)
+                    inflight[n++] = active[j];
+                for (size_t j = i + 1; j < nactive; j++)
+                    inflight[n++] = active[j];
+                state = flush_batch(states, inflight, n, 0);
+            }
+
+            states[lane] = state;
+            pos[lane]++;
+            if (accepting[state]) {
+                accepted[lane] = true;
+            }
+            else if (state != dead_state && pos[lane] < lengths[lane]) {
+                __builtin_prefetch(
+                    &table[state * class_count +
+                           symbol_class[words[lane][pos[lane]]]]);
+                active[remaining++] = lane;
+            }
+        }
+        nactive = remaining;
+    }
+}
+
+/// Computes packet frequency over a batch of words.
+/// @param state_freq mapping of indexes to state packet frequency
+/// @param words packet payloads
+/// @param lengths the length of each payload
+/// @param nwords number of payloads, at most batch_size
+/// @param counts if set, the number of packets carrying each payload
+void LazyDfa::label_states_batch(
+    StateFreq &state_freq, const Word *words, const unsigned *lengths,
+    size_t nwords, const size_t *counts)
+{
+    size_t current = nwords;
+    parse_batch(words, lengths, nwords, [&](size_t word, StateIdx s) {
+        // calls for one word are consecutive
+        if (word != current) {
+            current = word;
+            if (++freq_epoch == 0) {
+                fill(freq_stamp.begin(), freq_stamp.end(), 0);
+                freq_epoch = 1;
+            }
+        }
+        if (freq_stamp[s] != freq_epoch) {
+            freq_stamp[s] = freq_epoch;
+            state_freq[s] += counts ? counts[word] : 1;
+        }
+    });
+
+    size_t total = nwords;
+    if (counts)
+        total = accumulate(counts, counts + nwords, size_t(0));
+    state_freq[nfa.get_initial_state_idx()] += total;
+}
+
+/// Computes packet frequency over a giver string (payload).
+/// @param state_freq mapping of indexes to state packet frequency
+/// @param payload string data
+/// @param len the length of payload
+/// @param count number of packets carrying the payload
+void LazyDfa::label_states(
+    StateFreq &state_freq, const unsigned char *payload,
+    unsigned len, size_t count)
+{
+    if (++freq_epoch == 0) {
+        fill(freq_stamp.begin(), freq_stamp.end(), 0);
+        freq_epoch = 1;
+    }
+
+    parse_word(payload, len, [&](StateIdx s) {
+        if (freq_stamp[s] != freq_epoch) {
+            freq_stamp[s] = freq_epoch;
+            state_freq[s] += count;
+        }
+    });
+
+    state_freq[nfa.get_initial_state_idx()] += count;
+}
@@ -0,0 +1,322 @@
+/// @author Jakub Semric
+/// 2018
+
+#pragma once
+
+#include <iostream>
+#include <vector>
+#include <unordered_map>
+
+#include "nfa.hpp"
+
+namespace reduction
+{
+
+using namespace std;
+
+/// Hit, miss and flush counters of the lazy DFA cache.
+struct LazyDfaCounters
+{
+    size_t hits;        // transitions found in the cache
+    size_t misses;      // transitions computed by subset construction
+    size_t flushes;     // number of cache flushes
+    size_t states;      // DFA states created in total
+
+    LazyDfaCounters() : hits{0}, misses{0}, flushes{0}, states{0} {}
+
+    void aggregate(const LazyDfaCounters &c)
+    {
+        hits += c.hits;
+        misses += c.misses;
+        flushes += c.flushes;
+        states += c.states;
+    }
+
+    void print(ostream &out = cerr) const;
+};
+
+/// Deterministic automaton built on demand from NfaArray.
+/// Each distinct set of active states reached while reading a word becomes
+/// a cached DFA state with a table of successors over all symbol classes.
+/// Successors are computed by subset construction when needed for the first
+/// time. If the cache exceeds the memory limit, it is flushed and built
+/// again from scratch. The object modifies its cache while parsing words,
+/// so each thread has to use its own instance.
+class LazyDfa
+{
+public:
+    /// max. number of words parsed in lock-step
+    static const size_t batch_size = 16;
+
+private:
+    struct SetHash
+    {
+        size_t operator()(const vector<StateIdx> &v) const
+        {
+            size_t h = 14695981039346656037ULL;
+            for (auto i : v) {
+                h = (h ^ i) * 1099511628211ULL;
+            }
+            return h;
+        }
+    };
+
+    const NfaArray &nfa;
+    /// symbol classes of nfa
+    uint8_t symbol_class[256];
+    unsigned class_count;
+    size_t mem_limit;
+    size_t mem_used;
+
+    /// set of NFA states -> DFA state
+    unordered_map<vector<StateIdx>, uint32_t, SetHash> index;
+    /// DFA state -> set of NFA states (keys of index)
+    vector<const vector<StateIdx>*> sets;
+    /// (DFA state * class_count) + symbol class = DFA state or unknown
+    vector<uint32_t> table;
+    /// DFA state -> 1 if it contains a final state
+    vector<uint8_t> accepting;
+
+    uint32_t init_state;
+    uint32_t dead_state;
+
+    /// scratch memory for subset construction
+    vector<StateIdx> pending;
+    vector<uint32_t> nfa_stamp;
+    uint32_t nfa_epoch;
+    /// DFA states visited by the current word
+    vector<uint32_t> visited;
+    /// (DFA state * batch_size) + word of a batch = number of the last call
+    /// of parse_word or parse_batch which visited the state by the word
+    vector<uint32_t> visit_stamp;
+    uint32_t word_cnt;
+    /// NFA states counted by the current call of label_states
+    vector<uint32_t> freq_stamp;
+    uint32_t freq_epoch;
+
+    LazyDfaCounters counters;
+
+    static const uint32_t unknown = ~0U;
+
+    /// DFA states visited by the words of the current batch
+    vector<uint32_t> lane_visited[batch_size];
+    /// NFA states of visited DFA states which have been flushed
+    vector<StateIdx> lane_flushed[batch_size];
+
+    uint32_t add_state(const vector<StateIdx> &set);
+    uint32_t find_or_add(const vector<StateIdx> &set);
+    uint32_t compute_next(uint32_t state, unsigned cls);
+    uint32_t flush_and_add_pending();
+    uint32_t flush_batch(
+        uint32_t *states, const size_t *lanes, size_t nlanes, size_t nwords);
+    void flush();
+
+    /// Returns the successor of DFA state over a symbol, or unknown if the
+    /// cache is full and has to be flushed. The successor set is kept in
+    /// pending in such case.
+    uint32_t next_state(uint32_t state, Symbol symbol)
+    {
+        unsigned cls = symbol_class[symbol];
+        uint32_t next = table[state * class_count + cls];
+        if (next != unknown) {
+            counters.hits++;
+            return next;
+        }
+        return compute_next(state, cls);
+    }
+
+public:
+    /// default cache size in MB
+    static const size_t default_mem_limit = 64;
+
+    LazyDfa(const NfaArray &nfa, size_t mem_limit_mb = default_mem_limit);
+    ~LazyDfa() = default;
+
+    const LazyDfaCounters& get_counters() const { return counters;}
+    size_t state_count() const { return sets.size();}
+    size_t memory_usage() const { return mem_used;}
+
+    template<typename FuncType>
+    void parse_word(const Word word, unsigned length, FuncType handler);
+
+    bool accept(const Word word, unsigned length);
+
+    void label_states(
+        StateFreq &state_freq, const unsigned char *payload,
+        unsigned len, size_t count = 1);
+
+    template<typename FuncType>
+    void parse_batch(
+        const Word *words, const unsigned *lengths, size_t nwords,
+        FuncType handler);
+
+    void accept_batch(
+        const Word *words, const unsigned *lengths, size_t nwords,
+        bool *accepted);
+
+    void label_states_batch(
+        StateFreq &state_freq, const Word *words,
+        const unsigned *lengths, size_t nwords,
+        const size_t *counts = nullptr);
+};
+
+//^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
+// inline methods implementation of LazyDfa class
+//^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
+
+/// Parses a word through LazyDfa.
+/// @param word packet payload or string
+/// @param length number of bytes in string
+/// @param handler function which is called for each NFA state visited while
+/// reading the word, possibly more than once per state
+template<typename FuncType>
+void LazyDfa::parse_word(const Word word, unsigned length, FuncType handler)
+{
+    if (++word_cnt == 0) {
+        fill(visit_stamp.begin(), visit_stamp.end(), 0);
+        word_cnt = 1;
+    }
+    visited.clear();
+
+    uint32_t state = init_state;
+    for (unsigned i = 0; i < length; i++)
+    {
+        state = next_state(state, word[i]);
+        if (state == unknown)
+        {
+            // report visited states before their sets are flushed
+            for (auto j : visited) {
+                for (auto k : *sets[j])
+                    handler(k);
+            }
+            visited.clear();
+            state = flush_and_add_pending();
+        }
+
+        if (state == dead_state)
+            break;
+
+        if (visit_stamp[state * batch_size] != word_cnt)
+        {
+            visit_stamp[state * batch_size] = word_cnt;
+            visited.push_back(state);
+        }
+    }
+
+    for (auto j : visited) {
+        for (auto k : *sets[j])
+            handler(k);
+    }
+}
+
+/// Parses a word through LazyDfa and decides whether it is accepted.
+/// @param word packet payload or string
+/// @param length number of bytes in string
+/// @return True if a string is accepted, false otherwise
+inline bool LazyDfa::accept(const Word word, unsigned length)
+{
+    uint32_t state = init_state;
+    for (unsigned i = 0; i < length; i++)
+    {
+        state = next_state(state, word[i]);
+        if (state == unknown)
+            state = flush_and_add_pending();
+
+        if (accepting[state])
+            return true;
+        if (state == dead_state)
+            break;
+    }
+
+    return false;
+}
+
+/// Parses up to batch_size words through LazyDfa in lock-step. One byte of
+/// each word is read in turn and the next table row of each word is
+/// prefetched, so that cache misses of one word overlap with the work on
+/// the others.
+/// @param words packet payloads or strings
+/// @param lengths number of bytes of each word
+/// @param nwords number of words
+/// @param handler function which is called with the word index and an NFA
+/// state visited while reading the word, possibly more than once per state;
+/// calls for one word are not interleaved with calls for other words
+template<typename FuncType>
+void LazyDfa::parse_batch(
+    const Word *words, const unsigned *lengths, size_t nwords,
+    FuncType handler)
+{
+    assert(nwords <= batch_size);
+    uint32_t states[batch_size];
+    unsigned pos[batch_size];
+    size_t active[batch_size];
+    size_t nactive = 0;
+
+    if (++word_cnt == 0) {
+        fill(visit_stamp.begin(), visit_stamp.end(), 0);
+        word_cnt = 1;
+    }
+
+    for (size_t i = 0; i < nwords; i++)
+    {
+        states[i] = init_state;
+        pos[i] = 0;
+        lane_visited[i].clear();
+        lane_flushed[i].clear();
+        if (lengths[i])
+            active[nactive++] = i;
+    }
+
+    while (nactive)
+    {
+        size_t remaining = 0;
+        for (size_t i = 0; i < nactive; i++)
+        {
+            size_t lane = active[i];
+            uint32_t state = next_state(states[lane], words[lane][pos[lane]]);
+            if (state == unknown)
+            {
+                // words still in flight, except the current one
+                size_t inflight[batch_size];
+                size_t n = 0;
+                for (size_t j = 0; j < remaining; j++)
+                    inflight[n++] = active[j];
+                for (size_t j = i + 1; j < nactive; j++)
+                    inflight[n++] = active[j];
+                state = flush_batch(states, inflight, n, nwords);
+            }
+
+            states[lane] = state;
+            pos[lane]++;
+            if (state == dead_state)
+                continue;
+
+            if (visit_stamp[state * batch_size + lane] != word_cnt)
+            {
+                visit_stamp[state * batch_size + lane] = word_cnt;
+                lane_visited[lane].push_back(state);
+            }
+
+            if (pos[lane] < lengths[lane])
+            {
+                __builtin_prefetch(
+                    &table[state * class_count +
+                           symbol_class[words[lane][pos[lane]]]]);
+                active[remaining++] = lane;
+            }
+        }
+        nactive = remaining;
+    }
+
+    for (size_t i = 0; i < nwords; i++)
+    {
+        for (auto j : lane_visited[i]) {
+            for (auto k : *sets[j])
+                handler(i, k);
+        }
+        for (auto k : lane_flushed[i])
+            handler(i, k);
+    }
+}
+
+}   // end of namespace reduction
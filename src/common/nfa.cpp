@@ -2,31 +2,116 @@
 /// 2018
 
 #include <iostream>
-#include <sstream>
+#include <iterator>
 #include <fstream>
 #include <vector>
 #include <cassert>
 #include <map>
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "nfa.hpp"
 
 using namespace reduction;
 using namespace std;
 
-static uint8_t hex_to_int(const string &str)
+/// Scans the .fa format in a buffer. Numbers and symbols are converted by
+/// hand, so that nothing is allocated per line.
+/// @param p beginning of the buffer
+/// @param end end of the buffer
+/// @param init initial state
+/// @param trans transitions in the order of the file
+/// @param finals final states
+static void parse_fa(
+    const char *p, const char *end, State &init, vector<TransFormat> &trans,
+    set<State> &finals)
 {
-    assert(str.size() > 2);
+    auto skip_blank = [&]() {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+            p++;
+    };
+    auto skip_line = [&]() {
+        while (p < end && *p != '\n')
+            p++;
+        if (p < end)
+            p++;
+    };
+    auto at_token = [&]() {
+        skip_blank();
+        return p < end && *p != '\n';
+    };
+    auto number = [&]() {
+        if (p == end || !isdigit(*p))
+            throw runtime_error("invalid NFA syntax");
+        const State max = numeric_limits<State>::max();
+        State x = 0;
+        while (p < end && isdigit(*p)) {
+            State digit = *p++ - '0';
+            if (x > (max - digit) / 10)
+                throw runtime_error("invalid NFA syntax");
+            x = x * 10 + digit;
+        }
+        return x;
+    };
+    auto symbol = [&]() {
+        if (end - p < 3 || p[0] != '0' || tolower(p[1]) != 'x')
+            throw runtime_error("invalid NFA syntax");
+        p += 2;
+        unsigned x = 0;
+        const char *start = p;
+        while (p < end && isxdigit(*p)) {
+            int c = tolower(*p++);
+            x = x * 16 + (c - (c > '9' ? 'a' - 10 : '0'));
+            if (x > 255)
+                throw runtime_error("invalid NFA syntax");
+        }
+        // the symbol is followed by a blank or the end of the line
+        if (p == start || (p < end && !isspace(*p)))
+            throw runtime_error("invalid NFA syntax");
+        return static_cast<uint8_t>(x);
+    };
+
+    // reading initial state
+    skip_blank();
+    init = number();
+    skip_line();
+
+    // reading transitions, the first line which is not a transition begins
+    // the list of final states
+    bool in_finals = false;
+    while (p < end) {
+        if (!at_token()) {
+            skip_line();
+            continue;
+        }
 
-    int x = 0;
-    int m = 1;
-    for (int i = str.length()-1; i > 1; i--) {
-        int c = tolower(str[i]);
-        x += m * (c - (c > '9' ? 'a' - 10 : '0'));
-        m *= 16;
+        State s1 = number();
+        if (!in_finals && at_token()) {
+            State s2 = number();
+            if (!at_token())
+                throw runtime_error("invalid NFA syntax");
+            trans.push_back(TransFormat{s1, s2, symbol()});
+        }
+        else {
+            in_finals = true;
+            finals.insert(s1);
+        }
+        skip_line();
     }
-    assert(x >= 0 && x < 256);
+}
 
-    return static_cast<uint8_t>(x);
+/// Reads the whole file to a buffer and parses it.
+static void parse_fa(
+    istream &input, State &init, vector<TransFormat> &trans,
+    set<State> &finals)
+{
+    string buf{istreambuf_iterator<char>(input), istreambuf_iterator<char>()};
+    parse_fa(buf.data(), buf.data() + buf.size(), init, trans, finals);
 }
 
 static string int_to_hex(const unsigned num)
@@ -57,7 +142,7 @@ Nfa::Nfa(const Nfa &nfa)
 
 Nfa Nfa::read_from_file(const string input)
 {
-    ifstream in{input};
+    ifstream in{input, ios::binary};
     if (!in.is_open()) {
         throw runtime_error("cannot open NFA file");
     }
@@ -68,38 +153,11 @@ Nfa Nfa::read_from_file(const string input)
 
 Nfa Nfa::read_from_file(ifstream &input)
 {
-    bool no_final = true;
-    string buf;
     vector<TransFormat> trans;
     set<State> finals;
     State init;
 
-    try {
-        // reading initial state
-        getline(input, buf);
-        init = stoul(buf);
-
-        // reading transitions
-        while (getline(input, buf)) {
-            istringstream iss(buf);
-            string s1, s2, a;
-            if (!(iss >> s1 >> s2 >> a )) {
-                no_final = false;
-                break;
-            }
-            trans.push_back(TransFormat{stoul(s1), stoul(s2), hex_to_int(a)});
-        }
-        // set final states
-        if (!no_final) {
-            do {
-                finals.insert(stoul(buf));
-            } while (getline(input, buf));
-        }
-    }
-    catch (...) {
-        throw runtime_error("invalid NFA syntax");
-    }
-
+    parse_fa(input, init, trans, finals);
     return Nfa(init, trans, finals);
 }
 
@@ -144,33 +202,666 @@ void Nfa::print(ostream &out) const
 }
 
 
+/// Successors of each state over any symbol.
+map<State, set<State>> Nfa::succ() const
+{
+    map<State, set<State>> res;
+    for (auto &i : transitions) {
+        auto &succ = res[i.first];
+        for (auto &j : i.second)
+            succ.insert(j.second.begin(), j.second.end());
+    }
+    return res;
+}
+
+/// Length of the shortest path from the initial state to each state,
+/// unreachable states have depth 0.
+map<State, unsigned> Nfa::state_depth() const
+{
+    map<State, unsigned> depth;
+    for (auto &i : transitions)
+        depth[i.first] = 0;
+
+    auto succ = this->succ();
+    set<State> visited{initial_state};
+    vector<State> actual{initial_state};
+    for (unsigned d = 0; !actual.empty(); d++) {
+        vector<State> next;
+        for (auto q : actual) {
+            depth[q] = d;
+            for (auto r : succ[q]) {
+                if (visited.insert(r).second)
+                    next.push_back(r);
+            }
+        }
+        actual.swap(next);
+    }
+
+    return depth;
+}
+
+/// Finds all states from which a final state is reachable.
+/// @return final state -> states from which it is reachable, including itself
+map<State, set<State>> Nfa::fin_pred() const
+{
+    map<State, set<State>> pred;
+    for (auto &i : transitions) {
+        pred[i.first];
+        for (auto &j : i.second) {
+            for (auto q : j.second)
+                pred[q].insert(i.first);
+        }
+    }
+
+    map<State, set<State>> res;
+    for (auto f : final_states) {
+        auto &visited = res[f];
+        visited.insert(f);
+        vector<State> actual{f};
+        while (!actual.empty()) {
+            State q = actual.back();
+            actual.pop_back();
+            for (auto p : pred[q]) {
+                if (visited.insert(p).second)
+                    actual.push_back(p);
+            }
+        }
+    }
+
+    return res;
+}
+
+/// Merges states, transitions of a merged state are redirected to the state
+/// it is merged into.
+/// @param mapping state -> state it is merged into, which is not merged
+void Nfa::merge_states(const map<State,State> &mapping)
+{
+    for (auto &i : mapping) {
+        State p = i.first, q = i.second;
+        if (mapping.count(q))
+            throw runtime_error("merging not consistent");
+        if (!is_state(p) || !is_state(q))
+            throw runtime_error("invalid state id");
+        if (p == initial_state)
+            throw runtime_error("cannot merge initial state");
+
+        auto &rules = transitions[q];
+        for (auto &j : transitions[p])
+            rules[j.first].insert(j.second.begin(), j.second.end());
+        transitions.erase(p);
+        if (final_states.erase(p))
+            final_states.insert(q);
+    }
+
+    for (auto &i : transitions) {
+        for (auto &j : i.second) {
+            set<State> targets;
+            for (auto q : j.second) {
+                auto it = mapping.find(q);
+                targets.insert(it == mapping.end() ? q : it->second);
+            }
+            j.second.swap(targets);
+        }
+    }
+}
+
+/// Removes states together with their incoming and outgoing transitions.
+void Nfa::remove_states(const set<State> &states)
+{
+    if (states.count(initial_state))
+        throw runtime_error("cannot remove initial state");
+
+    for (auto s : states) {
+        transitions.erase(s);
+        final_states.erase(s);
+    }
+
+    for (auto &i : transitions) {
+        for (auto j = i.second.begin(); j != i.second.end(); ) {
+            auto &targets = j->second;
+            for (auto k = targets.begin(); k != targets.end(); )
+                k = states.count(*k) ? targets.erase(k) : next(k);
+            j = targets.empty() ? i.second.erase(j) : next(j);
+        }
+    }
+}
+
+/// Removes transitions, states are kept even if they have no transitions
+/// left. Transitions which do not exist are ignored.
+void Nfa::remove_transitions(const vector<TransFormat> &trans)
+{
+    for (auto &i : trans) {
+        auto rules = transitions.find(i.first);
+        if (rules == transitions.end())
+            continue;
+        auto targets = rules->second.find(i.third);
+        if (targets == rules->second.end())
+            continue;
+        targets->second.erase(i.second);
+        if (targets->second.empty())
+            rules->second.erase(targets);
+    }
+}
+
 //^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
 // implementation of NfaArray class methods
 //^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
 
-NfaArray::NfaArray(const Nfa &nfa) : Nfa{nfa}
+/// Rounds a position in the image up to the cache line size.
+static size_t align_pos(size_t pos)
 {
-    // map states
-    State cnt = 0;
-    state_map.clear();
-    for (auto i : transitions)
-        state_map[i.first] = cnt++;
+    return (pos + 63) & ~static_cast<size_t>(63);
+}
 
-    trans_vector = vector<vector<State>>(state_count() * alph_size);
-    for (auto i : transitions) {
-        size_t idx_state = state_map[i.first] << shift;
-        for (auto j : i.second) {
-            size_t symbol = j.first;
-            for (auto state : j.second) {
-                assert(idx_state + symbol < trans_vector.size());
-                trans_vector[idx_state + symbol].push_back(state_map[state]);
+NfaArray::NfaArray(const Nfa &nfa) :
+    initial_state{nfa.get_initial_state()},
+    final_states{nfa.get_final_states()}, mapping{nullptr}, mapping_size{0}
+{
+    vector<TransFormat> trans;
+    for (auto &i : nfa.transitions) {
+        for (auto &j : i.second) {
+            for (auto k : j.second) {
+                trans.push_back(TransFormat{i.first, k, j.first});
+            }
+        }
+    }
+    build(trans);
+}
+
+NfaArray::NfaArray(
+    State init, const vector<TransFormat> &trans, const set<State> &finals) :
+    initial_state{init}, final_states{finals}, mapping{nullptr},
+    mapping_size{0}
+{
+    build(trans);
+}
+
+/// Compiles the image from a list of transitions, initial and final states
+/// have to be set already.
+/// @param trans transitions in any order, possibly with duplicates
+void NfaArray::build(const vector<TransFormat> &trans)
+{
+    // map states, indexes are assigned in the order of labels
+    vector<uint64_t> state_labels{initial_state};
+    state_labels.insert(
+        state_labels.end(), final_states.begin(), final_states.end());
+    for (auto &i : trans) {
+        state_labels.push_back(i.first);
+        state_labels.push_back(i.second);
+    }
+    sort(state_labels.begin(), state_labels.end());
+    state_labels.erase(
+        unique(state_labels.begin(), state_labels.end()), state_labels.end());
+    size_t nstates = state_labels.size();
+
+    auto state_idx = [&state_labels](State state) {
+        return static_cast<StateIdx>(
+            lower_bound(state_labels.begin(), state_labels.end(), state) -
+            state_labels.begin());
+    };
+
+    struct Edge
+    {
+        StateIdx from;
+        StateIdx to;
+        unsigned symbol;
+    };
+
+    vector<Edge> edges;
+    edges.reserve(trans.size());
+    for (auto &i : trans) {
+        edges.push_back(Edge{state_idx(i.first), state_idx(i.second), i.third});
+    }
+
+    // sorting by symbol makes columns of the transition table contiguous
+    sort(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) {
+        return a.symbol != b.symbol ? a.symbol < b.symbol :
+               a.from != b.from ? a.from < b.from : a.to < b.to;
+    });
+    edges.erase(
+        unique(edges.begin(), edges.end(), [](const Edge &a, const Edge &b) {
+            return a.symbol == b.symbol && a.from == b.from && a.to == b.to;
+        }), edges.end());
+
+    size_t column[alph_size + 1] = {};
+    for (auto &i : edges) {
+        column[i.symbol + 1]++;
+    }
+    for (unsigned i = 0; i < alph_size; i++) {
+        column[i + 1] += column[i];
+    }
+
+    // symbols are equivalent if all states have the same successors over
+    // them, i.e. the columns of the transition table are equal
+    uint64_t column_hash[alph_size];
+    for (unsigned i = 0; i < alph_size; i++) {
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t j = column[i]; j < column[i + 1]; j++) {
+            h = (h ^ ((static_cast<uint64_t>(edges[j].from) << 32) |
+                edges[j].to)) * 1099511628211ULL;
+        }
+        column_hash[i] = h;
+    }
+
+    auto same_column = [&](unsigned a, unsigned b) {
+        return column_hash[a] == column_hash[b] &&
+            column[a + 1] - column[a] == column[b + 1] - column[b] &&
+            equal(edges.begin() + column[a], edges.begin() + column[a + 1],
+                edges.begin() + column[b], [](const Edge &x, const Edge &y) {
+                    return x.from == y.from && x.to == y.to;
+                });
+    };
+
+    vector<unsigned> class_symbol;
+    uint8_t symbol_class[alph_size];
+    for (unsigned i = 0; i < alph_size; i++) {
+        unsigned c = 0;
+        while (c < class_symbol.size() && !same_column(class_symbol[c], i))
+            c++;
+        if (c == class_symbol.size()) {
+            class_symbol.push_back(i);
+        }
+        symbol_class[i] = c;
+    }
+    size_t class_count = class_symbol.size();
+
+    // keep only columns of class representatives, sorted by state and class
+    vector<Edge> cells;
+    for (size_t c = 0; c < class_count; c++) {
+        unsigned a = class_symbol[c];
+        for (size_t j = column[a]; j < column[a + 1]; j++) {
+            cells.push_back(Edge{
+                edges[j].from, edges[j].to, static_cast<unsigned>(c)});
+        }
+    }
+    sort(cells.begin(), cells.end(), [](const Edge &a, const Edge &b) {
+        return a.from != b.from ? a.from < b.from :
+               a.symbol != b.symbol ? a.symbol < b.symbol : a.to < b.to;
+    });
+
+    // count successors of each (state, symbol class) cell, prefix sums give
+    // the beginning of each successor list
+    vector<uint32_t> trans_offsets(nstates * class_count + 1);
+    vector<StateIdx> trans_targets(cells.size());
+    for (size_t i = 0; i < cells.size(); i++) {
+        trans_offsets[cells[i].from * class_count + cells[i].symbol + 1]++;
+        trans_targets[i] = cells[i].to;
+    }
+    for (size_t i = 1; i < trans_offsets.size(); i++) {
+        trans_offsets[i] += trans_offsets[i - 1];
+    }
+
+    vector<uint8_t> final_flags(nstates);
+    for (auto i : final_states) {
+        final_flags[state_idx(i)] = 1;
+    }
+
+    // use bitset engine only if successor masks are small enough, scanning
+    // long bitsets is slower than the sparse set as only a few states are
+    // usually active
+    size_t mask_words = (nstates + 63) / 64;
+    vector<uint64_t> succ_masks, final_mask(mask_words);
+    for (size_t i = 0; i < nstates; i++) {
+        if (final_flags[i])
+            final_mask[i / 64] |= 1ULL << (i % 64);
+    }
+
+    if (mask_words <= mask_max_words &&
+        mask_words * 8 * nstates * class_count <= mask_limit)
+    {
+        succ_masks = vector<uint64_t>(nstates * class_count * mask_words);
+        for (size_t i = 0; i + 1 < trans_offsets.size(); i++) {
+            uint64_t *mask = &succ_masks[i * mask_words];
+            for (auto k = trans_offsets[i]; k < trans_offsets[i + 1]; k++) {
+                mask[trans_targets[k] / 64] |= 1ULL << (trans_targets[k] % 64);
+            }
+        }
+    }
+    else {
+        mask_words = 0;
+    }
+
+    // pack everything into one image
+    NfaImageHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, "AHOFANFA", sizeof(hdr.magic));
+    hdr.version = image_version;
+    hdr.byte_order = 0x01020304;
+    hdr.state_count = nstates;
+    hdr.trans_count = trans_targets.size();
+    hdr.class_count = class_count;
+    hdr.initial_idx = state_idx(initial_state);
+    hdr.mask_words = mask_words;
+    memcpy(hdr.symbol_class, symbol_class, sizeof(hdr.symbol_class));
+
+    size_t pos = align_pos(sizeof(hdr));
+    hdr.offsets_pos = pos;
+    pos = align_pos(pos + trans_offsets.size() * sizeof(uint32_t));
+    hdr.targets_pos = pos;
+    pos = align_pos(pos + trans_targets.size() * sizeof(StateIdx));
+    hdr.labels_pos = pos;
+    pos = align_pos(pos + nstates * sizeof(uint64_t));
+    hdr.finals_pos = pos;
+    pos = align_pos(pos + nstates);
+    hdr.masks_pos = pos;
+    pos = align_pos(pos + succ_masks.size() * sizeof(uint64_t));
+    hdr.final_mask_pos = pos;
+    pos = align_pos(pos + final_mask.size() * sizeof(uint64_t));
+    hdr.size = pos;
+
+    image = vector<uint64_t>(hdr.size / sizeof(uint64_t));
+    char *base = reinterpret_cast<char*>(image.data());
+    memcpy(base, &hdr, sizeof(hdr));
+    memcpy(base + hdr.offsets_pos, trans_offsets.data(),
+        trans_offsets.size() * sizeof(uint32_t));
+    memcpy(base + hdr.targets_pos, trans_targets.data(),
+        trans_targets.size() * sizeof(StateIdx));
+    memcpy(base + hdr.labels_pos, state_labels.data(),
+        nstates * sizeof(uint64_t));
+    memcpy(base + hdr.finals_pos, final_flags.data(), nstates);
+    memcpy(base + hdr.masks_pos, succ_masks.data(),
+        succ_masks.size() * sizeof(uint64_t));
+    memcpy(base + hdr.final_mask_pos, final_mask.data(),
+        final_mask.size() * sizeof(uint64_t));
+
+    attach(base, hdr.size);
+}
+
+NfaArray::NfaArray(const NfaArray &nfa) :
+    initial_state{nfa.initial_state}, final_states{nfa.final_states},
+    mapping{nullptr}, mapping_size{0}
+{
+    const char *data = reinterpret_cast<const char*>(nfa.header);
+    image = vector<uint64_t>(nfa.header->size / sizeof(uint64_t));
+    memcpy(image.data(), data, nfa.header->size);
+    attach(image.data(), nfa.header->size);
+}
+
+NfaArray::NfaArray(NfaArray &&nfa) :
+    initial_state{nfa.initial_state}, final_states{move(nfa.final_states)},
+    image{move(nfa.image)}, mapping{nfa.mapping},
+    mapping_size{nfa.mapping_size}
+{
+    nfa.mapping = nullptr;
+    nfa.mapping_size = 0;
+    if (mapping) {
+        attach(mapping, mapping_size);
+    }
+    else {
+        attach(image.data(), image.size() * sizeof(uint64_t));
+    }
+}
+
+NfaArray::NfaArray(void *mapping, size_t mapping_size) :
+    initial_state{0}, mapping{mapping}, mapping_size{mapping_size}
+{
+    try {
+        attach(mapping, mapping_size);
+    }
+    catch (...) {
+        munmap(mapping, mapping_size);
+        throw;
+    }
+
+    initial_state = state_labels[initial_idx];
+    for (size_t i = 0; i < nstates; i++) {
+        if (final_flags[i])
+            final_states.insert(state_labels[i]);
+    }
+}
+
+NfaArray::~NfaArray()
+{
+    if (mapping) {
+        munmap(mapping, mapping_size);
+    }
+}
+
+/// Sets pointers to the sections of an image and checks its consistency.
+/// @param data beginning of the image
+/// @param size size of the image in bytes
+void NfaArray::attach(const void *data, size_t size)
+{
+    const char *base = static_cast<const char*>(data);
+    header = static_cast<const NfaImageHeader*>(data);
+
+    if (size < sizeof(NfaImageHeader) ||
+        memcmp(header->magic, "AHOFANFA", sizeof(header->magic)))
+    {
+        throw runtime_error("not a compiled NFA image");
+    }
+    if (header->version != image_version ||
+        header->byte_order != 0x01020304)
+    {
+        throw runtime_error("unsupported version of compiled NFA image");
+    }
+
+    nstates = header->state_count;
+    class_count = header->class_count;
+    mask_words = header->mask_words;
+    // counts are bounded first, so that sizes of sections do not overflow
+    if (header->size > size || !nstates || nstates > UINT32_MAX ||
+        !class_count || class_count > alph_size ||
+        header->initial_idx >= nstates ||
+        (mask_words && mask_words != (nstates + 63) / 64))
+    {
+        throw runtime_error("corrupted compiled NFA image");
+    }
+
+    size_t cells = nstates * class_count;
+    if (!fits(header->offsets_pos, cells + 1, sizeof(uint32_t), size) ||
+        !fits(header->targets_pos, header->trans_count, sizeof(StateIdx),
+            size) ||
+        !fits(header->labels_pos, nstates, sizeof(uint64_t), size) ||
+        !fits(header->finals_pos, nstates, 1, size) ||
+        !fits(header->masks_pos, cells, mask_words * sizeof(uint64_t), size) ||
+        !fits(header->final_mask_pos, (nstates + 63) / 64, sizeof(uint64_t),
+            size))
+    {
+        throw runtime_error("corrupted compiled NFA image");
+    }
+
+    initial_idx = header->initial_idx;
+    memcpy(symbol_class, header->symbol_class, sizeof(symbol_class));
+    trans_offsets = reinterpret_cast<const uint32_t*>(
+        base + header->offsets_pos);
+    trans_targets = reinterpret_cast<const StateIdx*>(
+        base + header->targets_pos);
+    state_labels = reinterpret_cast<const uint64_t*>(
+        base + header->labels_pos);
+    final_flags = reinterpret_cast<const uint8_t*>(base + header->finals_pos);
+    succ_masks = mask_words ? reinterpret_cast<const uint64_t*>(
+        base + header->masks_pos) : nullptr;
+    final_mask = reinterpret_cast<const uint64_t*>(
+        base + header->final_mask_pos);
+
+    check();
+}
+
+/// @return true if a section of count items of the given size starting at
+/// pos fits into the image of size bytes and it is aligned to its items
+bool NfaArray::fits(uint64_t pos, uint64_t count, size_t item, size_t size)
+{
+    return pos % sizeof(uint64_t) == 0 && pos <= size &&
+        (!item || count <= (size - pos) / item);
+}
+
+/// Checks that the simulation never reads out of the image, i.e. that all
+/// states and symbol classes stored in the sections are in range. It is
+/// linear in the number of transitions, still much cheaper than parsing.
+void NfaArray::check() const
+{
+    auto corrupted = [] () {
+        throw runtime_error("corrupted compiled NFA image");
+    };
+
+    for (unsigned i = 0; i < alph_size; i++) {
+        if (symbol_class[i] >= class_count)
+            corrupted();
+    }
+
+    size_t cells = nstates * class_count;
+    if (trans_offsets[0] != 0 || trans_offsets[cells] != header->trans_count)
+        corrupted();
+    for (size_t i = 0; i < cells; i++) {
+        if (trans_offsets[i + 1] < trans_offsets[i])
+            corrupted();
+    }
+    for (size_t i = 0; i < header->trans_count; i++) {
+        if (trans_targets[i] >= nstates)
+            corrupted();
+    }
+
+    // labels are searched by binary search
+    for (size_t i = 1; i < nstates; i++) {
+        if (state_labels[i] <= state_labels[i - 1])
+            corrupted();
+    }
+
+    // bits of the last word of a bitset above the last state stay clear
+    size_t last = (nstates + 63) / 64 - 1;
+    uint64_t unused = nstates % 64 ? ~0ULL << (nstates % 64) : 0;
+    for (size_t i = 0; i < nstates; i++) {
+        bool final = (final_mask[i / 64] >> (i % 64)) & 1;
+        if (final_flags[i] > 1 || final != (final_flags[i] == 1))
+            corrupted();
+    }
+    if (final_mask[last] & unused)
+        corrupted();
+    for (size_t i = 0; succ_masks && i < cells; i++) {
+        if (succ_masks[i * mask_words + last] & unused)
+            corrupted();
+    }
+}
+
+/// @param fname file name
+/// @return true if the file starts with the magic of a compiled image
+bool NfaArray::is_image(const string &fname)
+{
+    char magic[8] = "";
+    ifstream in{fname, ios::binary};
+    return in.read(magic, sizeof(magic)) &&
+        !memcmp(magic, "AHOFANFA", sizeof(magic));
+}
+
+/// Loads an automaton either from a compiled image, which is mapped to
+/// memory, or from the .fa format.
+/// @param fname file name
+NfaArray NfaArray::load(const string &fname)
+{
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw runtime_error("cannot open NFA file");
+    }
+
+    char magic[8] = "";
+    struct stat st;
+    if (fstat(fd, &st) < 0 || read(fd, magic, sizeof(magic)) < 0) {
+        close(fd);
+        throw runtime_error("cannot read NFA file");
+    }
+
+    if (memcmp(magic, "AHOFANFA", sizeof(magic))) {
+        // text format is compiled directly without building Nfa
+        string buf(st.st_size, '\0');
+        if (pread(fd, &buf[0], st.st_size, 0) != st.st_size) {
+            close(fd);
+            throw runtime_error("cannot read NFA file");
+        }
+        close(fd);
+
+        State init;
+        vector<TransFormat> trans;
+        set<State> finals;
+        parse_fa(buf.data(), buf.data() + buf.size(), init, trans, finals);
+        return NfaArray(init, trans, finals);
+    }
+
+    void *mapping = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        throw runtime_error("cannot map NFA file");
+    }
+
+    return NfaArray(mapping, st.st_size);
+}
+
+/// Writes the compiled image, which can be loaded by NfaArray::load.
+/// @param fname output file name
+void NfaArray::write(const string &fname) const
+{
+    ofstream out{fname, ios::binary};
+    if (!out.is_open()) {
+        throw runtime_error("cannot open output file");
+    }
+    out.write(reinterpret_cast<const char*>(header), header->size);
+    if (!out) {
+        throw runtime_error("cannot write compiled NFA image");
+    }
+}
+
+/// Hash of the compiled image, equal for an automaton built from the .fa
+/// format and for its image loaded from a file.
+uint64_t NfaArray::image_hash() const
+{
+    const uint64_t *p = reinterpret_cast<const uint64_t*>(header);
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < header->size / sizeof(uint64_t); i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+/// Prints the automaton in the .fa format.
+void NfaArray::print(ostream &out) const
+{
+    out << initial_state << "\n";
+
+    for (size_t i = 0; i < nstates; i++) {
+        for (unsigned j = 0; j < alph_size; j++) {
+            for (auto k = succ_begin(i, symbol_class[j]);
+                 k != succ_end(i, symbol_class[j]); k++)
+            {
+                out << state_labels[i] << " " << state_labels[*k] << " "
+                    << int_to_hex(j) << "\n";
             }
         }
     }
+
+    for (auto i : final_states) {
+        out << i << "\n";
+    }
+}
+
+set<State> NfaArray::get_final_states() const
+{
+    return final_states;
+}
+
+set<State> NfaArray::get_states() const
+{
+    return set<State>(state_labels, state_labels + nstates);
 }
 
-NfaArray::NfaArray(const NfaArray &nfa) : NfaArray{static_cast<Nfa>(nfa)}
+bool NfaArray::is_state(State state) const
 {
+    return binary_search(state_labels, state_labels + nstates, state);
+}
+
+bool NfaArray::is_final(State state) const
+{
+    return final_states.find(state) != final_states.end();
+}
+
+/// Compute mapping of the states labels of original NFA to indexes.
+/// @return mapping of the states labels to indexes
+map<State,State> NfaArray::get_state_map() const
+{
+    map<State,State> ret;
+    for (size_t i = 0; i < nstates; i++)
+    {
+        ret[state_labels[i]] = i;
+    }
+    return ret;
 }
 
 /// Compute indexes mapped to the states labels of original NFA.
@@ -178,9 +869,9 @@ NfaArray::NfaArray(const NfaArray &nfa) : NfaArray{static_cast<Nfa>(nfa)}
 map<State,State> NfaArray::get_reversed_state_map() const
 {
     map<State,State> ret;
-    for (auto i : state_map)
+    for (size_t i = 0; i < nstates; i++)
     {
-        ret[i.second] = i.first;
+        ret[i] = state_labels[i];
     }
     return ret;
 }
@@ -190,25 +881,153 @@ map<State,State> NfaArray::get_reversed_state_map() const
 vector<State> NfaArray::get_final_state_idx() const
 {
     vector<State> ret;
-    for (auto i : final_states)
+    for (size_t i = 0; i < nstates; i++)
     {
-        ret.push_back(state_map.at(i));
+        if (final_flags[i])
+            ret.push_back(i);
     }
     return ret;
 }
 
-/// Computes packet frequency over a giver string (payload).
-/// @param state_freq mapping of indexes to state packet frequency
-/// @param payload string data
-/// @param len the length of payload
-void NfaArray::label_states(
-    vector<size_t> &state_freq, const unsigned char *payload,
-    unsigned len) const
+ScanContext::ScanContext(const NfaArray &nfa) :
+    nfa{nfa}, stamp(nfa.state_count()), epoch{0},
+    active_bits(nfa.mask_words), next_bits(nfa.mask_words),
+    mark(nfa.state_count()), word_id{0}
+{
+    active.reserve(nfa.state_count());
+    next.reserve(nfa.state_count());
+    visited.reserve(nfa.state_count());
+    matched.reserve(nfa.get_final_states().size());
+#ifdef NFA_PROFILE
+    profile = Profiler::instance().attach(nfa);
+#endif
+}
+
+#ifdef NFA_PROFILE
+ScanContext::~ScanContext()
+{
+    if (profile)
+        Profiler::instance().detach(nfa, *profile);
+}
+#endif
+
+/// Parses a word and decides whether it is accepted.
+/// @param word packet payload or string
+/// @param length number of bytes in string
+/// @return True if a string is accepted, false otherwise
+bool ScanContext::accept(const Word word, unsigned length)
+{
+    return nfa.uses_bitset() ? accept_bitset(word, length) :
+                               accept_sparse(word, length);
+}
+
+bool ScanContext::accept_sparse(const Word word, unsigned length)
+{
+    bool final = false;
+    start();
+    for (unsigned i = 0; i < length && !active.empty() && !final; i++) {
+        step(word[i], [this, &final](StateIdx s) {
+            final |= nfa.final_flags[s];
+        });
+    }
+
+    return final;
+}
+
+bool ScanContext::accept_bitset(const Word word, unsigned length)
+{
+    start_bitset();
+    for (unsigned i = 0; i < length && step_bitset(word[i]); i++) {
+        for (size_t w = 0; w < active_bits.size(); w++) {
+            if (active_bits[w] & nfa.final_mask[w]) {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/// Parses a word and returns final states matched by it. Final states are
+/// looked up in the bitset of final states, the bitset engine tests whole
+/// words of active states.
+/// @param word packet payload or string
+/// @param length number of bytes in string
+/// @param offsets if set, all matches are stored to it as pairs of final
+/// state and offset of the byte following the match
+/// @return matched final states in the order of the first match, each state
+/// once, valid until the next call
+const vector<StateIdx> &ScanContext::match(
+    const Word word, unsigned length, vector<Match> *offsets)
+{
+    word_id++;
+    matched.clear();
+    if (offsets)
+        offsets->clear();
+
+    auto add_match = [&](StateIdx s, unsigned offset) {
+        if (offsets)
+            offsets->push_back(Match(s, offset));
+        if (mark[s] != word_id) {
+            mark[s] = word_id;
+            matched.push_back(s);
+        }
+    };
+
+    if (nfa.uses_bitset()) {
+        start_bitset();
+        for (unsigned i = 0; i < length && step_bitset(word[i]); i++) {
+            for (size_t w = 0; w < active_bits.size(); w++) {
+                uint64_t bits = active_bits[w] & nfa.final_mask[w];
+                for (; bits; bits &= bits - 1)
+                    add_match(w * 64 + __builtin_ctzll(bits), i + 1);
+            }
+        }
+    }
+    else {
+        start();
+        for (unsigned i = 0; i < length && !active.empty(); i++) {
+            step(word[i], [&](StateIdx s) {
+                if (is_final(s))
+                    add_match(s, i + 1);
+            });
+        }
+    }
+
+    return matched;
+}
+
+/// Parses a word and returns all states visited by it, each state once.
+/// @param word packet payload or string
+/// @param length number of bytes in string
+/// @return visited states, valid until the next call
+const vector<StateIdx> &ScanContext::visited_states(
+    const Word word, unsigned length)
+{
+    word_id++;
+    visited.clear();
+    parse_word(word, length, [this](StateIdx s) {
+        if (mark[s] != word_id) {
+            mark[s] = word_id;
+            visited.push_back(s);
+        }
+    });
+
+    return visited;
+}
+
+/// Computes packet frequency of states, each state visited by the payload is
+/// counted once and the initial state is counted always.
+/// @param state_freq frequency of each state
+/// @param payload packet payload
+/// @param len payload length
+/// @param count number of packets carrying the payload
+void ScanContext::label_states(
+    StateFreq &state_freq, const unsigned char *payload, unsigned len,
+    size_t count)
 {
-    vector<bool> bm(state_count());
-    parse_word(payload, len, [&bm](State s){ bm[s] = 1; });
-    for (size_t i = 0; i < state_freq.size(); i++)
-        state_freq[i] += bm[i];
+    for (auto s : visited_states(payload, len))
+        state_freq[s] += count;
 
-    state_freq[get_initial_state_idx()]++;
+    state_freq[nfa.initial_idx] += count;
 }
@@ -9,11 +9,15 @@
 #include <map>
 #include <unordered_map>
 #include <set>
+#include <algorithm>
 #include <exception>
 #include <cassert>
 #include <stdio.h>
 #include <ctype.h>
 
+#include "counters.hpp"
+#include "profile.hpp"
+
 namespace reduction {
 
 using namespace std;
@@ -34,15 +38,19 @@ struct Triple
 using StrVec = vector<string>;
 using Symbol = uint8_t;
 using State = unsigned long;
+// compact state index used inside compiled automata
+using StateIdx = uint32_t;
 // since we use only packets words can only consist bytes
 using Word = const unsigned char*;
 // transitions serialization format
 using TransFormat = Triple<State, State, uint8_t>;
 
-auto default_lambda = [](){;};
+static auto default_lambda = [](){;};
 
 class Nfa
 {
+    friend class NfaArray;
+
 protected:
     State initial_state;
     set<State> final_states;
@@ -69,116 +77,432 @@ public:
     bool is_final(State state) const {
         return final_states.find(state) != final_states.end();
     }
+
+    map<State, set<State>> succ() const;
+    map<State, unsigned> state_depth() const;
+    map<State, set<State>> fin_pred() const;
+
+    // modifications
+    void merge_states(const map<State,State> &mapping);
+    void remove_states(const set<State> &states);
+    void remove_transitions(const vector<TransFormat> &trans);
+};
+
+/// Header of the compiled NfaArray image. The image is relocatable, all
+/// sections are addressed by their position from the beginning of the image
+/// and aligned to the cache line size.
+struct NfaImageHeader
+{
+    char magic[8];              // "AHOFANFA"
+    uint32_t version;
+    uint32_t byte_order;        // 0x01020304 in the native byte order
+    uint64_t size;              // size of the whole image in bytes
+    uint64_t state_count;
+    uint64_t trans_count;       // size of the targets section
+    uint64_t class_count;
+    uint64_t initial_idx;
+    uint64_t mask_words;        // 0 if the sparse engine is used
+    uint64_t offsets_pos;       // uint32_t[state_count * class_count + 1]
+    uint64_t targets_pos;       // StateIdx[trans_count]
+    uint64_t labels_pos;        // uint64_t[state_count], index -> label
+    uint64_t finals_pos;        // uint8_t[state_count]
+    uint64_t masks_pos;         // uint64_t[state_count * class_count *
+                                //          mask_words]
+    uint64_t final_mask_pos;    // uint64_t[(state_count + 63) / 64]
+    uint8_t symbol_class[256];
 };
 
+class ScanContext;
+
 /// Faster manipulation with transitions as in NFA class.
 /// This class should be used only for computing state frequencies or computing
-/// the number of accepted words. No modification of states and rules after
-/// initialization is recommended.
-class NfaArray : public Nfa
+/// the number of accepted words. It is not an Nfa, only queries valid for
+/// the compiled image are provided and the automaton cannot be modified.
+///
+/// Two simulation engines are available and selected by the state count.
+/// Small automata keep the active states in a dense bitset and compute the
+/// next set as word-level OR of precomputed successor masks. Larger automata,
+/// whose masks would not fit into the cache, keep the active states in a
+/// sparse set with epoch stamps.
+///
+/// All data are stored in one image described by NfaImageHeader. The image is
+/// either built from Nfa or mapped read-only from a file written by write(),
+/// so that compiled automata are loaded without any parsing and shared by
+/// processes through the page cache.
+class NfaArray
 {
 private:
-    /// state + symbol = set of states
-    /// faster then map, however harder to modify
-    vector<vector<State>> trans_vector;
-    /// state label -> index in trans_vector
-    map<State,State> state_map;
+    friend class ScanContext;
+
+    State initial_state;
+    set<State> final_states;
+    /// image built in memory, empty if the image is mapped from a file
+    vector<uint64_t> image;
+    /// memory mapped image
+    void *mapping;
+    size_t mapping_size;
+    /// beginning of the image, either built or mapped
+    const NfaImageHeader *header;
+
+    /// (state * class_count) + symbol class = range of successors in
+    /// trans_targets, i.e. successors are
+    /// trans_targets[trans_offsets[i]..trans_offsets[i+1]]
+    const uint32_t *trans_offsets;
+    /// successors of all states and symbols stored in one contiguous array
+    const StateIdx *trans_targets;
+    /// state index -> state label
+    const uint64_t *state_labels;
+    /// state index -> 1 if the state is final
+    const uint8_t *final_flags;
+
+    /// number of 64-bit words of a state bitset
+    size_t mask_words;
+    /// ((state * class_count) + symbol class) * mask_words = bitset of
+    /// successors, null if the sparse engine is used
+    const uint64_t *succ_masks;
+    /// bitset of final states over state indexes
+    const uint64_t *final_mask;
+
+    /// symbol -> symbol class, symbols of one class have the same successors
+    /// in all states
+    uint8_t symbol_class[256];
+    /// number of symbol classes
+    unsigned class_count;
+    size_t nstates;
+    StateIdx initial_idx;
 
-    static const unsigned shift = 8;
     static const unsigned alph_size = 256;
+    /// max. size of successor masks in bytes and max. number of words of
+    /// a state bitset, otherwise sparse engine is used
+    static const size_t mask_limit = 1 << 22;
+    static const size_t mask_max_words = 4;
+    static const uint32_t image_version = 2;
+
+    NfaArray(void *mapping, size_t mapping_size);
+    void build(const vector<TransFormat> &trans);
+    void attach(const void *data, size_t size);
+    static bool fits(uint64_t pos, uint64_t count, size_t item, size_t size);
+    void check() const;
 
 public:
     NfaArray(const Nfa &nfa);
+    NfaArray(
+        State init, const vector<TransFormat> &trans,
+        const set<State> &finals);
     NfaArray(const NfaArray &nfa);
+    NfaArray(NfaArray &&nfa);
+    NfaArray& operator=(const NfaArray &nfa) = delete;
 
-    ~NfaArray() {}
+    ~NfaArray();
+
+    // IO
+    static NfaArray load(const string &fname);
+    static bool is_image(const string &fname);
+    void write(const string &fname) const;
+    void print(ostream &out = cout) const;
+
+    // getters
+    set<State> get_final_states() const;
+    State get_initial_state() const { return initial_state;}
+    set<State> get_states() const;
+    unsigned long state_count() const { return nstates;}
+    unsigned long trans_count() const {
+        return trans_offsets[nstates * class_count];
+    }
+    bool is_state(State state) const;
+    bool is_final(State state) const;
 
-    map<State,State> get_state_map() const {return state_map;}
+    map<State,State> get_state_map() const;
     map<State,State> get_reversed_state_map() const;
     vector<State> get_final_state_idx() const;
-    size_t get_initial_state_idx() const { return state_map.at(initial_state);}
+    size_t get_initial_state_idx() const { return initial_idx;}
+    bool uses_bitset() const { return succ_masks != nullptr;}
+    bool is_final_idx(StateIdx state) const { return final_flags[state];}
+    State get_state_label(StateIdx state) const { return state_labels[state];}
 
-    void label_states(
-        vector<size_t> &state_freq, const unsigned char *payload,
-        unsigned len) const;
+    uint64_t image_hash() const;
+
+    unsigned get_class_count() const { return class_count;}
+    unsigned get_symbol_class(Symbol symbol) const {
+        return symbol_class[symbol];
+    }
+
+    /// Successors of state with given index over a symbol class.
+    const StateIdx *succ_begin(StateIdx state, unsigned cls) const {
+        return trans_targets +
+            trans_offsets[static_cast<size_t>(state) * class_count + cls];
+    }
+    const StateIdx *succ_end(StateIdx state, unsigned cls) const {
+        return trans_targets +
+            trans_offsets[static_cast<size_t>(state) * class_count + cls + 1];
+    }
+};
+
+
+/// Scratch memory for the simulation of NfaArray. It is created once per
+/// thread and reused by all packets, so that the simulation does not
+/// allocate memory. Buffers are reset in O(active states) between packets,
+/// the automaton itself is only read, so each thread needs its own context.
+class ScanContext
+{
+private:
+    const NfaArray &nfa;
+    /// active states of the sparse engine
+    vector<StateIdx> active;
+    vector<StateIdx> next;
+    /// a state is in the next set if its stamp equals to the epoch
+    vector<uint64_t> stamp;
+    uint64_t epoch;
+    /// active states of the bitset engine
+    vector<uint64_t> active_bits;
+    vector<uint64_t> next_bits;
+    /// a state has been visited by the word if its mark equals to word_id
+    vector<uint64_t> mark;
+    uint64_t word_id;
+    /// states visited by the last word
+    vector<StateIdx> visited;
+#ifdef NFA_PROFILE
+    /// counters of the simulation, nullptr if it is not profiled
+    unique_ptr<SimProfile> profile;
+#endif
+
+    template<typename FuncType1, typename FuncType2>
+    void parse_word_sparse(
+        const Word word, unsigned length, FuncType1 visited_state_handler,
+        FuncType2 loop_handler);
+
+    template<typename FuncType1, typename FuncType2>
+    void parse_word_bitset(
+        const Word word, unsigned length, FuncType1 visited_state_handler,
+        FuncType2 loop_handler);
+
+    bool accept_sparse(const Word word, unsigned length);
+    bool accept_bitset(const Word word, unsigned length);
+
+    /// final states matched by the last word
+    vector<StateIdx> matched;
+
+    void start_bitset();
+    bool step_bitset(Symbol symbol);
+    bool is_final(StateIdx state) const {
+        return (nfa.final_mask[state / 64] >> (state % 64)) & 1;
+    }
+
+public:
+    /// final state and offset of the byte following the match
+    typedef pair<StateIdx, unsigned> Match;
+
+    ScanContext(const NfaArray &nfa);
+#ifdef NFA_PROFILE
+    ~ScanContext();
+#endif
+
+    const NfaArray &get_nfa() const { return nfa;}
 
     template<typename FuncType1, typename FuncType2 = decltype(default_lambda)>
     void parse_word(
         const Word word, unsigned length, FuncType1 visited_state_handler,
-        FuncType2 loop_handler = default_lambda) const;
+        FuncType2 loop_handler = default_lambda);
 
-    bool accept(const Word word, unsigned length) const;
+    template<typename FuncType>
+    void parse_word_from(
+        vector<StateIdx> &states, const Word word, unsigned length,
+        FuncType visited_state_handler);
+
+    bool accept(const Word word, unsigned length);
+
+    const vector<StateIdx> &visited_states(const Word word, unsigned length);
+
+    const vector<StateIdx> &match(
+        const Word word, unsigned length, vector<Match> *offsets = nullptr);
+
+    void label_states(
+        StateFreq &state_freq, const unsigned char *payload,
+        unsigned len, size_t count = 1);
+
+    // simulation byte by byte, sparse engine is used
+    void start()
+    {
+        NFA_PROFILE_HOOK(packet());
+        active.assign(1, nfa.initial_idx);
+    }
+    bool dead() const { return active.empty();}
+    template<typename FuncType>
+    void step(Symbol symbol, FuncType visited_state_handler);
 };
 
 
 //^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
-// inline methods implementation of NfaArray class
+// inline methods implementation of ScanContext class
 //^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^
 
-/// Parses a word through NfaArray
+/// Parses a word from the initial state.
 /// @param word packet payload or string
 /// @param length number of bytes in string
 /// @param visited_state_handler function which is called after a state has
-/// been visited by a packet
+/// been visited by a packet, at most once per state and byte
 /// @param loop_handler function which is called after one byte has been read
 template<typename FuncType1, typename FuncType2>
-void NfaArray::parse_word(
+void ScanContext::parse_word(
     const Word word, unsigned length, FuncType1 visited_state_handler,
-    FuncType2 loop_handler) const
+    FuncType2 loop_handler)
 {
-    set<State> actual{state_map.at(initial_state)};
+    if (nfa.uses_bitset()) {
+        parse_word_bitset(word, length, visited_state_handler, loop_handler);
+    }
+    else {
+        parse_word_sparse(word, length, visited_state_handler, loop_handler);
+    }
+}
 
-    for (unsigned i = 0; i < length && !actual.empty(); i++)
+/// Moves active states by one symbol, sparse engine is used.
+/// @param symbol read symbol
+/// @param visited_state_handler function which is called after a state has
+/// been visited, at most once per state
+template<typename FuncType>
+void ScanContext::step(Symbol symbol, FuncType visited_state_handler)
+{
+    unsigned cls = nfa.symbol_class[symbol];
+    epoch++;
+    next.clear();
+    NFA_PROFILE_HOOK(byte(active.size()));
+    for (auto j : active)
     {
-        set<State> next;
-        for (auto j : actual)
+        size_t idx = static_cast<size_t>(j) * nfa.class_count + cls;
+        NFA_PROFILE_HOOK(transition(
+            nfa.trans_offsets[idx + 1] - nfa.trans_offsets[idx]));
+        for (auto k = nfa.trans_offsets[idx]; k < nfa.trans_offsets[idx + 1];
+            k++)
         {
-            assert ((j << shift) + word[i] < trans_vector.size());
-            auto trans = trans_vector[(j << shift) + word[i]];
-
-            if (!trans.empty())
+            StateIdx s = nfa.trans_targets[k];
+            if (stamp[s] != epoch)
             {
-                for (auto k : trans)
-                {
-                    // do something with visited state, use this information
-                    visited_state_handler(k);
-                    next.insert(k);
-                }
+                stamp[s] = epoch;
+                NFA_PROFILE_HOOK(visit(s));
+                // do something with visited state, use this information
+                visited_state_handler(s);
+                next.push_back(s);
             }
         }
+    }
+    swap(active, next);
+}
+
+/// Parses a word, active states are kept in a sparse set. A state is member of
+/// the next set if its stamp equals to the epoch of the current byte.
+template<typename FuncType1, typename FuncType2>
+void ScanContext::parse_word_sparse(
+    const Word word, unsigned length, FuncType1 visited_state_handler,
+    FuncType2 loop_handler)
+{
+    start();
+    for (unsigned i = 0; i < length && !active.empty(); i++)
+    {
+        step(word[i], visited_state_handler);
         // call function to do something at the end of current iteration
         loop_handler();
-        actual = move(next);
     }
 }
 
-/// Parses a word through NfaArray and decides whether it is accepted.
+/// Parses a word starting in the set of active states instead of the initial
+/// state, the set is replaced by the states active after the last byte. It
+/// allows to continue the simulation over segments of a stream.
+/// @param states active states, updated by the word
 /// @param word packet payload or string
 /// @param length number of bytes in string
-/// @return True if a string is accepted, false otherwise
-inline bool NfaArray::accept(const Word word, unsigned length) const
+/// @param visited_state_handler function which is called after a state has
+/// been visited by a packet, at most once per state and byte
+template<typename FuncType>
+void ScanContext::parse_word_from(
+    vector<StateIdx> &states, const Word word, unsigned length,
+    FuncType visited_state_handler)
+{
+    // states are copied, so that the caller does not get the large buffer
+    active.assign(states.begin(), states.end());
+    for (unsigned i = 0; i < length && !active.empty(); i++)
+        step(word[i], visited_state_handler);
+    states.assign(active.begin(), active.end());
+}
+
+/// Parses a word, active states are kept in a bitset.
+template<typename FuncType1, typename FuncType2>
+void ScanContext::parse_word_bitset(
+    const Word word, unsigned length, FuncType1 visited_state_handler,
+    FuncType2 loop_handler)
 {
-    set<State> actual{state_map.at(initial_state)};
-    auto state_map = get_reversed_state_map();
-
-    for (unsigned i = 0; i < length && !actual.empty(); i++) {
-        set<State> next;
-        for (auto j : actual) {
-            assert ((j << shift) + word[j] < trans_vector.size());
-            auto trans = trans_vector[(j << shift) + word[i]];
-            if (!trans.empty()) {
-                for (auto k : trans) {
-                    if (final_states.find(state_map.at(k)) != final_states.end()) {
-                        return true;
-                    }
-                    next.insert(k);
-                }
+    start_bitset();
+    // loop_handler is called also on the byte after which no state is active,
+    // as the sparse engine does
+    bool alive = true;
+    for (unsigned i = 0; i < length && alive; i++)
+    {
+        alive = step_bitset(word[i]);
+        for (size_t w = 0; w < active_bits.size(); w++)
+        {
+            for (uint64_t bits = active_bits[w]; bits; bits &= bits - 1)
+            {
+                // do something with visited state, use this information
+                visited_state_handler(w * 64 + __builtin_ctzll(bits));
             }
         }
-        actual = move(next);
+        // call function to do something at the end of current iteration
+        loop_handler();
+    }
+}
+
+/// Sets the initial state as the only active state of the bitset engine.
+inline void ScanContext::start_bitset()
+{
+    size_t init = nfa.initial_idx;
+    NFA_PROFILE_HOOK(packet());
+    fill(active_bits.begin(), active_bits.end(), 0);
+    active_bits[init / 64] = 1ULL << (init % 64);
+}
+
+/// Moves active states of the bitset engine by one symbol.
+/// @param symbol read symbol
+/// @return false if no state is active
+inline bool ScanContext::step_bitset(Symbol symbol)
+{
+    size_t mask_words = nfa.mask_words;
+    size_t class_count = nfa.class_count;
+    unsigned cls = nfa.symbol_class[symbol];
+    fill(next_bits.begin(), next_bits.end(), 0);
+#ifdef NFA_PROFILE
+    if (profile) {
+        size_t n = 0;
+        for (size_t w = 0; w < mask_words; w++)
+            n += __builtin_popcountll(active_bits[w]);
+        profile->byte(n);
+    }
+#endif
+    for (size_t w = 0; w < mask_words; w++)
+    {
+        for (uint64_t bits = active_bits[w]; bits; bits &= bits - 1)
+        {
+            size_t j = w * 64 + __builtin_ctzll(bits);
+            const uint64_t *mask =
+                &nfa.succ_masks[(j * class_count + cls) * mask_words];
+            for (size_t k = 0; k < mask_words; k++) {
+                next_bits[k] |= mask[k];
+                NFA_PROFILE_HOOK(transition(__builtin_popcountll(mask[k])));
+            }
+        }
+    }
+    swap(active_bits, next_bits);
+#ifdef NFA_PROFILE
+    if (profile) {
+        for (size_t w = 0; w < mask_words; w++) {
+            for (uint64_t bits = active_bits[w]; bits; bits &= bits - 1)
+                profile->visit(w * 64 + __builtin_ctzll(bits));
+        }
     }
+#endif
 
-    return false;
+    uint64_t any = 0;
+    for (size_t w = 0; w < mask_words; w++)
+        any |= active_bits[w];
+    return any != 0;
 }
 
 }   // end of namespace reduction
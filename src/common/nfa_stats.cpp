@@ -4,111 +4,617 @@
 #include <iostream>
 #include <ostream>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <memory>
 #include <ctype.h>
 
 #include "nfa_stats.hpp"
 #include "nfa.hpp"
+#include "lazy_dfa.hpp"
 #include "pcap_reader.hpp"
+#include "work_queue.hpp"
+#include "pipeline.hpp"
+#include "target_cache.hpp"
 
 namespace reduction
 {
 
-/// Computes statistics of the reduced automaton.
+/// Max. number of packets in one chunk of work.
+static const unsigned long chunk_size = 4096;
+/// Max. number of packets passed through the pipeline at once.
+static const size_t pipeline_batch_size = 64;
+
+/// Chunk of packets of one PCAP file.
+struct PcapTask
+{
+    size_t pcap;    // index of PCAP file
+    size_t index;   // index of the chunk in PCAP file
+    pcapreader::PcapChunk chunk;
+};
+
+/// Updates classification statistics by packets with the same payload.
+/// @param stats statistics to be updated
+/// @param match1 number of final states of reduced automaton reached
+/// @param match2 number of final states of target automaton reached
+/// @param consistent if set, check whether reduced is over-approximation
+/// @param n number of packets
+static void classify_packet(
+    NfaStats &stats, int match1, int match2, bool consistent, size_t n)
+{
+    if (match1 != match2) {
+        stats.fp_c += n;
+        stats.all_c += (match1 - match2) * n;
+        if (consistent && match2 > match1)
+            throw runtime_error(
+                "Reduced automaton ain't "
+                "over-approximation!\n");
+    }
+    else if (match1) {
+        stats.pp_c += n;
+    }
+    // accepted packet false/positive positive
+    if (consistent) {
+        if (match1 && match2)
+            stats.pp_a += n;
+        else if (match1 && !match2)
+            stats.fp_a += n;
+    }
+    else {
+        if (match2) stats.pp_a += n; else stats.fp_a += n;
+    }
+}
+
+/// Simulation state of one reduced automaton within a worker.
+struct ReducedState
+{
+    const NfaArray &nfa;
+    LazyDfa dfa;
+    ScanContext ctx;
+    // reached final states of each packet in a batch
+    vector<StateIdx> finals[LazyDfa::batch_size];
+    // handler calls for one packet are consecutive, so states already
+    // reported for the packet are marked with its number
+    vector<size_t> mark;
+
+    ReducedState(const NfaArray &nfa, size_t lazy_dfa_mem) :
+        nfa{nfa}, dfa{nfa, lazy_dfa_mem}, ctx{nfa}, mark(nfa.state_count())
+    {}
+};
+
+/// Per-thread state of the computation of statistics, it updates the
+/// statistics of all reduced automata by batches of payloads. Each payload
+/// is read once and the target is simulated at most once for all of them.
+class StatsWorker
+{
+private:
+    const NfaArray &target;
+    vector<unique_ptr<ReducedState>> reduced;
+    bool consistent;
+    size_t lazy_dfa_mem;
+    LazyDfa target_dfa;
+
+    // reached final states of the target of each packet in a batch
+    vector<StateIdx> finals2[LazyDfa::batch_size];
+    vector<size_t> mark2;
+    size_t packet;
+
+    // simulation of the target over one packet without lazy DFA
+    ScanContext target_ctx;
+
+    // results of the target over the current chunk, which are either read
+    // instead of simulating the target, or recorded
+    ChunkMatches *cache;
+    bool record;
+    uint32_t ordinal;
+    size_t next_match;
+
+    bool simulate_target() const { return !cache || record;}
+    void cached_finals(vector<StateIdx> &found);
+    void record_finals(const vector<StateIdx> &found);
+    void update_stats(size_t i, vector<NfaStats> &stats, size_t n);
+    void update_stats(
+        size_t i, const pcapreader::PayloadBatch &batch, size_t j,
+        vector<NfaStats> *stats);
+
+    void process_packet(
+        const pcapreader::PayloadBatch &batch, size_t j,
+        vector<NfaStats> *stats);
+
+    void process_lazy(
+        const pcapreader::PayloadBatch &batch, size_t j, size_t n,
+        vector<NfaStats> *stats);
+
+public:
+    /// @param target original automaton
+    /// @param reduced reduced automata
+    /// @param consistent if set, check whether reduced is over-approximation
+    /// @param lazy_dfa_mem if non-zero, simulate automata by lazy DFA with
+    /// cache of the given size in MB
+    StatsWorker(
+        const NfaArray &target, const vector<const NfaArray*> &reduced,
+        bool consistent, size_t lazy_dfa_mem) :
+        target{target}, consistent{consistent}, lazy_dfa_mem{lazy_dfa_mem},
+        target_dfa{target, lazy_dfa_mem}, mark2(target.state_count()),
+        packet{0}, target_ctx{target}, cache{nullptr}, record{false},
+        ordinal{0}, next_match{0}
+    {
+        for (auto r : reduced)
+            this->reduced.emplace_back(new ReducedState(*r, lazy_dfa_mem));
+    }
+
+    void begin_chunk(ChunkMatches *matches, bool record);
+    void end_chunk();
+    void process(
+        const pcapreader::PayloadBatch &batch, vector<NfaStats> *stats);
+
+    void add_counters(LazyDfaCounters &counters) const
+    {
+        if (lazy_dfa_mem) {
+            counters.aggregate(target_dfa.get_counters());
+            for (auto &r : reduced)
+                counters.aggregate(r->dfa.get_counters());
+        }
+    }
+};
+
+/// Updates statistics of each reduced automaton by results of i-th packet
+/// simulated in lock-step.
+/// @param i index of the packet in finals
+/// @param stats statistics of each reduced automaton
+/// @param n number of packets with the payload
+void StatsWorker::update_stats(size_t i, vector<NfaStats> &stats, size_t n)
+{
+    auto &found2 = finals2[i];
+    for (size_t k = 0; k < reduced.size(); k++) {
+        auto &found1 = reduced[k]->finals[i];
+        auto &s = stats[k];
+        s.total += n;
+        for (auto j : found1)
+            s.reduced_states_arr[j] += n;
+        if (found1.empty() && !consistent)
+            continue;
+
+        for (auto j : found2)
+            s.target_states_arr[j] += n;
+        classify_packet(s, found1.size(), found2.size(), consistent, n);
+    }
+}
+
+/// Updates statistics by j-th payload of a batch. Payload of a corpus is
+/// counted in each PCAP file where it occurs by the number of its packets.
+/// @param i index of the packet in finals
+/// @param stats statistics of each reduced automaton over each PCAP file
+/// of the batch, i.e. over each PCAP file of a corpus
+void StatsWorker::update_stats(
+    size_t i, const pcapreader::PayloadBatch &batch, size_t j,
+    vector<NfaStats> *stats)
+{
+    if (!batch.corpus) {
+        update_stats(i, stats[0], 1);
+        return;
+    }
+
+    auto &corpus = *batch.corpus;
+    auto end = corpus.sources_end(batch.ids[j]);
+    for (auto src = corpus.sources_begin(batch.ids[j]); src != end; src++)
+        update_stats(i, stats[src->pcap], src->count);
+}
+
+/// Updates statistics of reduced automata by one packet. All automata are
+/// simulated in one pass over the payload. The target starts when some
+/// reduced automaton reaches a final state for the first time (or at once
+/// if consistent is set), its simulation catches up over the bytes read so
+/// far and then all advance together until they die or the payload ends.
+/// @param batch packet payloads
+/// @param j index of the packet in the batch
+/// @param stats statistics of each reduced automaton, see update_stats
+void StatsWorker::process_packet(
+    const pcapreader::PayloadBatch &batch, size_t j, vector<NfaStats> *stats)
+{
+    const unsigned char *payload = batch.payloads[j];
+    unsigned len = batch.lengths[j];
+    // reached final states are collected to finals[0] and finals2[0]
+    size_t id = ++packet;
+    auto &found2 = finals2[0];
+    found2.clear();
+    for (auto &r : reduced) {
+        r->finals[0].clear();
+        r->ctx.start();
+    }
+
+    auto target_handler = [&](StateIdx s) {
+        if (target.is_final_idx(s) && mark2[s] != id) {
+            mark2[s] = id;
+            found2.push_back(s);
+        }
+    };
+
+    bool target_on = simulate_target() && (consistent || record);
+    if (target_on)
+        target_ctx.start();
+
+    for (unsigned i = 0; i < len; i++) {
+        bool matched = false, alive = target_on && !target_ctx.dead();
+        for (auto &p : reduced) {
+            auto &r = *p;
+            if (r.ctx.dead())
+                continue;
+            alive = true;
+            r.ctx.step(payload[i], [&](StateIdx s) {
+                if (r.nfa.is_final_idx(s) && r.mark[s] != id) {
+                    r.mark[s] = id;
+                    r.finals[0].push_back(s);
+                }
+            });
+            matched |= !r.finals[0].empty();
+        }
+
+        if (!alive)
+            break;
+
+        if (!target_on && simulate_target() && matched) {
+            // something was matched, lets find the difference
+            target_on = true;
+            target_ctx.start();
+            for (unsigned j = 0; j < i && !target_ctx.dead(); j++)
+                target_ctx.step(payload[j], target_handler);
+        }
+        if (target_on && !target_ctx.dead())
+            target_ctx.step(payload[i], target_handler);
+    }
+
+    if (!simulate_target())
+        cached_finals(found2);
+    else if (record)
+        record_finals(found2);
+
+    update_stats(0, batch, j, stats);
+}
+
+/// Updates statistics of reduced automata by at most LazyDfa::batch_size
+/// packets simulated in lock-step by lazy DFA.
+/// @param batch packet payloads
+/// @param j index of the first packet in the batch
+/// @param n number of packets
+/// @param stats statistics of each reduced automaton, see update_stats
+void StatsWorker::process_lazy(
+    const pcapreader::PayloadBatch &batch, size_t j, size_t n,
+    vector<NfaStats> *stats)
+{
+    const Word *payloads = batch.payloads.data() + j;
+    const unsigned *lengths = batch.lengths.data() + j;
+    size_t first = packet + 1;
+    packet += n;
+    bool matched[LazyDfa::batch_size] = {};
+    for (size_t i = 0; i < n; i++)
+        finals2[i].clear();
+
+    for (auto &p : reduced) {
+        auto &r = *p;
+        for (size_t i = 0; i < n; i++)
+            r.finals[i].clear();
+
+        r.dfa.parse_batch(
+            payloads, lengths, n,
+            [&](size_t word, StateIdx s) {
+                if (r.mark[s] != first + word) {
+                    r.mark[s] = first + word;
+                    if (r.nfa.is_final_idx(s)) {
+                        r.finals[word].push_back(s);
+                        matched[word] = true;
+                    }
+                }
+            });
+    }
+
+    // simulate target only over packets which need it
+    Word words[LazyDfa::batch_size];
+    unsigned target_lengths[LazyDfa::batch_size];
+    size_t index[LazyDfa::batch_size];
+    size_t m = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!simulate_target()) {
+            cached_finals(finals2[i]);
+        }
+        else if (matched[i] || consistent || record) {
+            words[m] = payloads[i];
+            target_lengths[m] = lengths[i];
+            index[m++] = i;
+        }
+    }
+
+    if (simulate_target()) {
+        target_dfa.parse_batch(
+            words, target_lengths, m,
+            [&](size_t word, StateIdx s) {
+                if (mark2[s] != first + index[word]) {
+                    mark2[s] = first + index[word];
+                    if (target.is_final_idx(s))
+                        finals2[index[word]].push_back(s);
+                }
+            });
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (record)
+            record_finals(finals2[i]);
+        update_stats(i, batch, j + i, stats);
+    }
+}
+
+/// Starts processing of a chunk.
+/// @param matches results of the target over the chunk, nullptr if the
+/// target is simulated and the results are not recorded
+/// @param record if set, the target is simulated over all packets and its
+/// results are recorded to matches, otherwise they are read from it
+void StatsWorker::begin_chunk(ChunkMatches *matches, bool record)
+{
+    cache = matches;
+    this->record = record;
+    ordinal = 0;
+    next_match = 0;
+    if (cache && record)
+        *cache = ChunkMatches();
+}
+
+/// Checks that the chunk has as many packets as recorded.
+void StatsWorker::end_chunk()
+{
+    if (cache && record)
+        cache->packets = ordinal;
+    else if (cache && ordinal != cache->packets)
+        throw runtime_error("target cache does not match PCAP file");
+}
+
+/// Reads final states of the target reached by the current packet.
+void StatsWorker::cached_finals(vector<StateIdx> &found)
+{
+    found.clear();
+    auto &c = *cache;
+    if (next_match < c.index.size() && c.index[next_match] == ordinal) {
+        found.assign(
+            c.finals.begin() + c.offsets[next_match],
+            c.finals.begin() + c.offsets[next_match + 1]);
+        next_match++;
+    }
+    ordinal++;
+}
+
+/// Records final states of the target reached by the current packet.
+void StatsWorker::record_finals(const vector<StateIdx> &found)
+{
+    auto &c = *cache;
+    if (!found.empty()) {
+        c.index.push_back(ordinal);
+        c.finals.insert(c.finals.end(), found.begin(), found.end());
+        c.offsets.push_back(c.finals.size());
+    }
+    ordinal++;
+}
+
+/// Updates statistics of reduced automata by a batch of packets.
+/// @param batch packet payloads
+/// @param stats statistics of each reduced automaton over PCAP file of the
+/// batch, or over each PCAP file of its corpus
+void StatsWorker::process(
+    const pcapreader::PayloadBatch &batch, vector<NfaStats> *stats)
+{
+    NFA_PROFILE_STAGE(timer, "match");
+    if (!lazy_dfa_mem) {
+        for (size_t i = 0; i < batch.size(); i++) {
+            process_packet(batch, i, stats);
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < batch.size(); i += LazyDfa::batch_size) {
+        process_lazy(
+            batch, i, min(batch.size() - i, LazyDfa::batch_size), stats);
+    }
+}
+
+/// Processes chunks of PCAP files taken from the work queue.
+/// @param worker worker number
+/// @param queue shared work queue
+/// @param stop set when some worker fails, so that others stop too
+/// @param stats statistics of each PCAP file and reduced automaton, updated
+/// by the worker
+/// @param base index of the statistics of each input file, a corpus has
+/// statistics of each of its PCAP files
+/// @param counters lazy DFA counters are added to it
+static void compute_nfa_stats_worker(
+    const NfaArray &target, const vector<const NfaArray*> &reduced,
+    const vector<string> &pcaps, unsigned worker,
+    WorkStealingQueue<PcapTask> &queue, atomic<bool> &stop,
+    bool consistent, size_t lazy_dfa_mem, vector<vector<NfaStats>> &stats,
+    const vector<size_t> &base, LazyDfaCounters &counters,
+    const vector<unique_ptr<TargetCache>> &caches, const vector<bool> &record)
+{
+    StatsWorker w(target, reduced, consistent, lazy_dfa_mem);
+    // each file is opened once by the worker
+    vector<unique_ptr<pcapreader::ChunkReader>> readers(pcaps.size());
+    PcapTask task;
+
+    try {
+        while (!stop && queue.pop(worker, task)) {
+            auto s = &stats[base[task.pcap]];
+            auto &cache = caches[task.pcap];
+            auto &reader = readers[task.pcap];
+            if (!reader) {
+                reader.reset(
+                    new pcapreader::ChunkReader(pcaps[task.pcap].c_str()));
+            }
+            w.begin_chunk(
+                cache ? &cache->chunk(task.index) : nullptr,
+                record[task.pcap]);
+            pcapreader::process_payload_chunk_batch(
+                *reader, task.chunk,
+                [&] (const pcapreader::PayloadBatch &batch) {
+                    w.process(batch, s);
+                }, LazyDfa::batch_size);
+            w.end_chunk();
+        }
+    }
+    catch (...) {
+        stop = true;
+        throw;
+    }
+
+    w.add_counters(counters);
+}
+
+/// Computes statistics of reduced automata. PCAP files are split into
+/// chunks of packets, which are distributed among workers with work
+/// stealing, so that even a single large PCAP file is processed in parallel.
+/// In the pipeline mode, PCAP files are read by one thread and matched by
+/// the workers. Each packet is read once and the target is simulated at
+/// most once for all reduced automata.
 /// @param target original automaton
-/// @param reduced reduced automaton (has to be over-approximation of target!)
-/// @param pcaps filenames of PCAP files
+/// @param reduced reduced automata (have to be over-approximations of
+/// target!)
+/// @param pcaps filenames of PCAP files or corpora created by pcap_corpus
+/// @param nworkers number of threads
 /// @param consistent if set, check whether reduced is over-approximation
-/// @return  vector of pairs, where the first item is the PCAP file and the
-/// second item is statistic of reduced automaton over this file
-vector<pair<string,NfaStats>> compute_nfa_stats(
-    const NfaArray &target, const NfaArray &reduced, const vector<string> &pcaps,
-    bool consistent)
+/// @param lazy_dfa_mem if non-zero, simulate automata by lazy DFA with cache
+/// of the given size in MB per automaton and worker
+/// @param counters if set, lazy DFA counters are added to it
+/// @param pipeline if set, use the pipeline mode and add its counters to it
+/// @param cache_dir if set, results of the target are read from sidecar files
+/// in the directory instead of simulating the target, missing or outdated
+/// files are written
+/// @return  for each reduced automaton, vector of pairs, where the first item
+/// is the PCAP file and the second item is statistic of the reduced
+/// automaton over this file, a corpus is replaced by its PCAP files
+vector<vector<pair<string,NfaStats>>> compute_nfa_stats(
+    const NfaArray &target, const vector<const NfaArray*> &reduced,
+    const vector<string> &pcaps, unsigned nworkers, bool consistent,
+    size_t lazy_dfa_mem, LazyDfaCounters *counters,
+    pcapreader::PipelineCounters *pipeline, const string &cache_dir)
 {
-    for (auto i : pcaps) {
+    if (pipeline && cache_dir != "")
+        throw runtime_error("target cache is not supported in pipeline mode");
+
+    vector<PcapTask> tasks;
+    vector<unique_ptr<TargetCache>> caches(pcaps.size());
+    vector<bool> record(pcaps.size());
+    // names of PCAP files, whose statistics are computed, and the index of
+    // the first of them of each input file
+    vector<string> names;
+    vector<size_t> base;
+    for (size_t i = 0; i < pcaps.size(); i++) {
         char err_buf[4096] = "";
         pcap_t *p;
 
-        if (!(p = pcap_open_offline(i.c_str(), err_buf)))
-            throw runtime_error("Not a valid pcap file: \'" + i + "'");
-
-        pcap_close(p);
-    }
-
-    auto fidx_target = target.get_final_state_idx();
-    auto fidx_reduced = reduced.get_final_state_idx();
-    vector<pair<string,NfaStats>> results;
-
-    for (auto p : pcaps) {
-        NfaStats stats(reduced.state_count(), target.state_count());
-        try {
-            pcapreader::process_payload(
-                p.c_str(),
-                [&] (const unsigned char *payload, unsigned len)
-                {
-                    // bit vector of reached states
-                    // 0 - not reached, 1 - reached
-                    vector<bool> bm(reduced.state_count());
-                    //cerr << "8\n";
-                    reduced.parse_word(
-                        payload, len, [&bm](State s){ bm[s] = 1; });
-                    //cerr << "10\n";
-                    int match1 = 0;
-                    stats.total++;
-                    for (size_t i = 0; i < fidx_reduced.size(); i++) {
-                        size_t idx = fidx_reduced[i];
-                        if (bm[idx]) {
-                            match1++;
-                            assert(idx < stats.reduced_states_arr.size());
-                            stats.reduced_states_arr[idx]++;
-                        }
-                    }
+        base.push_back(names.size());
+        if (pcapreader::PayloadCorpus::is_corpus(pcaps[i].c_str())) {
+            pcapreader::PayloadCorpus corpus(pcaps[i].c_str(), false);
+            names.insert(
+                names.end(), corpus.pcaps().begin(), corpus.pcaps().end());
+        }
+        else if (!(p = pcap_open_offline(pcaps[i].c_str(), err_buf))) {
+            throw runtime_error("Not a valid pcap file: \'" + pcaps[i] + "'");
+        }
+        else {
+            pcap_close(p);
+            names.push_back(pcaps[i]);
+        }
 
-                    int match2 = 0;
-                    if (match1 || consistent) {
-                        // something was matched, lets find the difference
-                        vector<bool> bm(target.state_count());
-                        target.parse_word(
-                            payload, len, [&bm](State s){ bm[s] = 1; });
-                        for (size_t i = 0; i < fidx_target.size(); i++) {
-                            size_t idx = fidx_target[i];
-                            if (bm[idx]) {
-                                match2++;
-                                assert(idx < stats.target_states_arr.size());
-                                stats.target_states_arr[idx]++;
-                            }
-                        }
-
-                        if (match1 != match2) {
-                            stats.fp_c++;
-                            stats.all_c += match1 - match2;
-                            if (consistent && match2 > match1)
-                                throw runtime_error(
-                                    "Reduced automaton ain't "
-                                    "over-approximation!\n");
-                        }
-                        else if (match1) {
-                            stats.pp_c++;
-                        }
-                        // accepted packet false/positive positive
-                        if (consistent) {
-                            if (match1 && match2)
-                                stats.pp_a++;
-                            else if (match1 && !match2)
-                                stats.fp_a++;
-                        }
-                        else {
-                            if (match2) stats.pp_a++; else stats.fp_a++;
-                        }
-                    }
-                });
-            results.push_back(pair<string,NfaStats>(p,stats));
+        if (pipeline)
+            continue;
+
+        auto chunks = pcapreader::index_pcap(pcaps[i].c_str(), chunk_size);
+        for (size_t j = 0; j < chunks.size(); j++)
+            tasks.push_back(PcapTask{i, j, chunks[j]});
+
+        if (cache_dir != "") {
+            caches[i].reset(
+                new TargetCache(target, pcaps[i], chunk_size, chunks.size()));
+            record[i] = !caches[i]->load(
+                caches[i]->filename(cache_dir, pcaps[i]));
         }
-        catch (exception &e) {
-            // other error
-            cerr << "Error while computing NFA stats: " << e.what() << "\n";
-            break;
+    }
+
+    // statistics of each worker, PCAP file and reduced automaton
+    vector<NfaStats> init;
+    for (auto r : reduced)
+        init.push_back(NfaStats(r->state_count(), target.state_count()));
+    vector<vector<vector<NfaStats>>> stats(
+        nworkers, vector<vector<NfaStats>>(names.size(), init));
+    LazyDfaCounters lazy_counters;
+
+    if (pipeline) {
+        vector<unique_ptr<StatsWorker>> workers;
+        for (unsigned i = 0; i < nworkers; i++) {
+            workers.emplace_back(
+                new StatsWorker(target, reduced, consistent, lazy_dfa_mem));
+        }
+
+        pcapreader::process_payload_pipeline(
+            pcaps,
+            [&] (unsigned worker, size_t pcap,
+                const pcapreader::PayloadBatch &batch)
+            {
+                workers[worker]->process(batch, &stats[worker][base[pcap]]);
+            }, nworkers, pipeline_batch_size, ~0UL, pipeline);
+
+        for (auto &i : workers)
+            i->add_counters(lazy_counters);
+    }
+    else {
+        WorkStealingQueue<PcapTask> queue(tasks, nworkers);
+        atomic<bool> stop{false};
+        vector<LazyDfaCounters> worker_counters(nworkers);
+        vector<future<void>> threads;
+        for (unsigned i = 0; i < nworkers; i++) {
+            threads.push_back(
+                async(
+                    launch::async, compute_nfa_stats_worker, ref(target),
+                    ref(reduced), ref(pcaps), i, ref(queue), ref(stop),
+                    consistent, lazy_dfa_mem, ref(stats[i]), ref(base),
+                    ref(worker_counters[i]), ref(caches), ref(record)));
+        }
+
+        // exception of a worker is rethrown, futures of the others wait for
+        // them in destructors
+        for (auto &i : threads)
+            i.get();
+
+        for (auto &i : worker_counters)
+            lazy_counters.aggregate(i);
+
+        for (size_t i = 0; i < pcaps.size(); i++) {
+            if (record[i])
+                caches[i]->save(caches[i]->filename(cache_dir, pcaps[i]));
+        }
+    }
+
+    vector<vector<pair<string,NfaStats>>> results(reduced.size());
+    for (size_t i = 0; i < names.size(); i++) {
+        for (size_t k = 0; k < reduced.size(); k++) {
+            for (unsigned j = 1; j < nworkers; j++)
+                stats[0][i][k].aggregate(stats[j][i][k]);
+            results[k].push_back(
+                pair<string,NfaStats>(names[i], stats[0][i][k]));
         }
     }
+
+    if (counters)
+        counters->aggregate(lazy_counters);
+
     return results;
 }
+
+/// Computes statistics of one reduced automaton, see above.
+vector<pair<string,NfaStats>> compute_nfa_stats(
+    const NfaArray &target, const NfaArray &reduced,
+    const vector<string> &pcaps, unsigned nworkers, bool consistent,
+    size_t lazy_dfa_mem, LazyDfaCounters *counters,
+    pcapreader::PipelineCounters *pipeline, const string &cache_dir)
+{
+    return compute_nfa_stats(
+        target, vector<const NfaArray*>{&reduced}, pcaps, nworkers,
+        consistent, lazy_dfa_mem, counters, pipeline, cache_dir)[0];
+}
 }
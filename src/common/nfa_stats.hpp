@@ -8,6 +8,8 @@
 #include <vector>
 
 #include "nfa.hpp"
+#include "lazy_dfa.hpp"
+#include "pipeline.hpp"
 
 namespace reduction
 {
@@ -61,6 +63,18 @@ struct NfaStats
 
 vector<pair<string,NfaStats>> compute_nfa_stats(
     const NfaArray &target, const NfaArray &reduced,
-    const vector<string> &pcaps, bool consistent = false);
+    const vector<string> &pcaps, unsigned nworkers = 1,
+    bool consistent = false, size_t lazy_dfa_mem = 0,
+    LazyDfaCounters *counters = nullptr,
+    pcapreader::PipelineCounters *pipeline = nullptr,
+    const string &cache_dir = "");
+
+vector<vector<pair<string,NfaStats>>> compute_nfa_stats(
+    const NfaArray &target, const vector<const NfaArray*> &reduced,
+    const vector<string> &pcaps, unsigned nworkers = 1,
+    bool consistent = false, size_t lazy_dfa_mem = 0,
+    LazyDfaCounters *counters = nullptr,
+    pcapreader::PipelineCounters *pipeline = nullptr,
+    const string &cache_dir = "");
 
 }
@@ -7,7 +7,18 @@
 #include <iostream>
 #include <stdio.h>
 #include <cassert>
+#include <memory>
 #include <mutex>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <pcap.h>
 #include <pcap/pcap.h>
@@ -34,9 +45,462 @@ struct vlan_ethhdr {
     u_int16_t ether_type;
 } __attribute__ ((__packed__));
 
+/// Occurrences of a payload in one PCAP file of a corpus.
+struct CorpusSource
+{
+    uint32_t pcap;      // index of PCAP file in the corpus
+    uint32_t count;     // number of packets with the payload
+};
+
+/// Header of a corpus file, see PayloadCorpus.
+struct CorpusHeader
+{
+    char magic[8];          // "AHOFACRP"
+    uint32_t version;
+    uint32_t pcap_count;
+    uint64_t payload_count;
+    uint64_t source_count;
+    uint64_t data_size;
+    uint64_t names_size;
+};
+
+const char corpus_magic[8] = {'A', 'H', 'O', 'F', 'A', 'C', 'R', 'P'};
+const uint32_t corpus_version = 1;
+
+/// Corpus of distinct packet payloads extracted from PCAP files by
+/// pcap_corpus, mapped to memory. Each payload is stored once together with
+/// the number of packets carrying it in each of the original PCAP files.
+/// The file consists of CorpusHeader, payload_count + 1 offsets of payloads
+/// in the data, payload_count + 1 offsets of their sources, total count of
+/// each payload, CorpusSource entries, the payload data and null terminated
+/// names of the original PCAP files.
+class PayloadCorpus
+{
+private:
+    void *mapping;
+    size_t map_size;
+    CorpusHeader header;
+    const uint64_t *data_offsets;
+    const uint64_t *source_offsets;
+    const uint64_t *counts;
+    const CorpusSource *sources;
+    const unsigned char *data;
+    std::vector<std::string> names;
+
+    /// Checks the sizes of sections against the size of the file, that
+    /// offsets are monotonic and within their sections, that counts of
+    /// payloads are sums of their sources and that names are terminated
+    /// within their section, and sets the pointers to the sections.
+    /// @return false if the corpus file is corrupted
+    bool valid()
+    {
+        const uint64_t n = header.payload_count;
+        // each section fits into the file, so the sum does not overflow
+        if (memcmp(header.magic, corpus_magic, sizeof(corpus_magic)) ||
+            header.version != corpus_version ||
+            n >= map_size / (3 * sizeof(uint64_t)) ||
+            header.source_count > map_size / sizeof(CorpusSource) ||
+            header.data_size > map_size || header.names_size > map_size)
+        {
+            return false;
+        }
+
+        const size_t arrays = sizeof(header) + (3 * n + 2) * sizeof(uint64_t);
+        if (arrays + header.source_count * sizeof(CorpusSource) +
+            header.data_size + header.names_size != map_size)
+        {
+            return false;
+        }
+
+        auto base = static_cast<const unsigned char*>(mapping);
+        data_offsets = reinterpret_cast<const uint64_t*>(base + sizeof(header));
+        source_offsets = data_offsets + n + 1;
+        counts = source_offsets + n + 1;
+        sources = reinterpret_cast<const CorpusSource*>(base + arrays);
+        data = reinterpret_cast<const unsigned char*>(
+            sources + header.source_count);
+
+        if (data_offsets[0] != 0 || data_offsets[n] != header.data_size ||
+            source_offsets[0] != 0 || source_offsets[n] != header.source_count)
+        {
+            return false;
+        }
+        for (uint64_t i = 0; i < n; i++) {
+            if (data_offsets[i + 1] < data_offsets[i] ||
+                data_offsets[i + 1] - data_offsets[i] > UINT32_MAX ||
+                source_offsets[i + 1] < source_offsets[i])
+            {
+                return false;
+            }
+            uint64_t total = 0;
+            for (auto j = sources_begin(i); j != sources_end(i); j++) {
+                if (j->pcap >= header.pcap_count)
+                    return false;
+                total += j->count;
+            }
+            if (total != counts[i])
+                return false;
+        }
+
+        const char *name = reinterpret_cast<const char*>(
+            data + header.data_size);
+        const char *names_end = name + header.names_size;
+        for (uint32_t i = 0; i < header.pcap_count; i++) {
+            auto end = static_cast<const char*>(
+                memchr(name, '\0', names_end - name));
+            if (!end)
+                return false;
+            names.push_back(std::string(name, end));
+            name = end + 1;
+        }
+        return true;
+    }
+
+public:
+    /// Maps the corpus file.
+    /// @param fname filename of the corpus
+    /// @param populate read the whole file ahead, set unless only a part of
+    /// the corpus is processed
+    PayloadCorpus(const char *fname, bool populate = true) :
+        mapping{nullptr}, map_size{0}
+    {
+        int fd = open(fname, O_RDONLY);
+        if (fd == -1) {
+            throw std::ios_base::failure(
+                "cannot open corpus file '" + std::string(fname) + "'");
+        }
+
+        struct stat st;
+        void *addr = MAP_FAILED;
+        if (fstat(fd, &st) != -1 &&
+            static_cast<size_t>(st.st_size) >= sizeof(CorpusHeader))
+        {
+            addr = mmap(
+                nullptr, st.st_size, PROT_READ,
+                MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+        }
+        close(fd);
+        if (addr == MAP_FAILED) {
+            throw std::ios_base::failure(
+                "invalid corpus file '" + std::string(fname) + "'");
+        }
+
+        mapping = addr;
+        map_size = st.st_size;
+        memcpy(&header, mapping, sizeof(header));
+        if (!valid()) {
+            munmap(mapping, map_size);
+            throw std::ios_base::failure(
+                "invalid corpus file '" + std::string(fname) + "'");
+        }
+        madvise(mapping, map_size, MADV_SEQUENTIAL);
+    }
+
+    PayloadCorpus(const PayloadCorpus &) = delete;
+    PayloadCorpus &operator=(const PayloadCorpus &) = delete;
+
+    ~PayloadCorpus()
+    {
+        munmap(mapping, map_size);
+    }
+
+    /// @return true if the file starts with the corpus magic
+    static bool is_corpus(const char *fname)
+    {
+        char magic[sizeof(corpus_magic)];
+        FILE *f = fopen(fname, "rb");
+        if (!f)
+            return false;
+        bool res = fread(magic, sizeof(magic), 1, f) == 1 &&
+            !memcmp(magic, corpus_magic, sizeof(magic));
+        fclose(f);
+        return res;
+    }
+
+    /// number of distinct payloads
+    uint64_t size() const { return header.payload_count;}
+
+    const unsigned char *payload(uint64_t i) const
+    {
+        return data + data_offsets[i];
+    }
+
+    unsigned length(uint64_t i) const
+    {
+        return data_offsets[i + 1] - data_offsets[i];
+    }
+
+    /// number of packets carrying the payload in all PCAP files
+    uint64_t count(uint64_t i) const { return counts[i];}
+
+    /// occurrences of the payload in PCAP files, ordered by PCAP file
+    const CorpusSource *sources_begin(uint64_t i) const
+    {
+        return sources + source_offsets[i];
+    }
+
+    const CorpusSource *sources_end(uint64_t i) const
+    {
+        return sources + source_offsets[i + 1];
+    }
+
+    /// names of the original PCAP files
+    const std::vector<std::string> &pcaps() const { return names;}
+};
+
+/// Offset of payload in PayloadBatch which is not copied.
+const size_t no_offset = ~0UL;
+
+/// Payloads of several packets copied into one buffer, so that they can be
+/// processed at once.
+struct PayloadBatch
+{
+    std::vector<unsigned char> data;
+    std::vector<size_t> offsets;
+    /// valid only after calling finish()
+    std::vector<const unsigned char*> payloads;
+    std::vector<unsigned> lengths;
+    /// corpus of the payloads, nullptr if they are read from PCAP file
+    const PayloadCorpus *corpus = nullptr;
+    /// index of each payload in the corpus
+    std::vector<uint64_t> ids;
+
+    size_t size() const { return offsets.size();}
+    bool empty() const { return offsets.empty();}
+
+    /// @return number of packets carrying i-th payload
+    size_t count(size_t i) const
+    {
+        return corpus ? corpus->count(ids[i]) : 1;
+    }
+
+    void push(const unsigned char *payload, unsigned len)
+    {
+        offsets.push_back(data.size());
+        payloads.push_back(nullptr);
+        lengths.push_back(len);
+        data.insert(data.end(), payload, payload + len);
+    }
+
+    /// Adds payload without copying, it has to stay valid until the batch
+    /// is processed.
+    void push_ref(const unsigned char *payload, unsigned len)
+    {
+        offsets.push_back(no_offset);
+        payloads.push_back(payload);
+        lengths.push_back(len);
+    }
+
+    /// Adds payload of the corpus without copying.
+    void push_corpus(const PayloadCorpus &c, uint64_t id)
+    {
+        corpus = &c;
+        ids.push_back(id);
+        push_ref(c.payload(id), c.length(id));
+    }
+
+    void finish()
+    {
+        for (size_t i = 0; i < offsets.size(); i++) {
+            if (offsets[i] != no_offset)
+                payloads[i] = data.data() + offsets[i];
+        }
+    }
+
+    void clear()
+    {
+        data.clear();
+        offsets.clear();
+        payloads.clear();
+        lengths.clear();
+        corpus = nullptr;
+        ids.clear();
+    }
+};
+
+/// Consecutive range of packet records in a PCAP file, or of payloads in
+/// a corpus.
+struct PcapChunk
+{
+    /// file offset of the first record, 0 means the beginning of the capture,
+    /// index of the first payload in a corpus
+    long offset;
+    /// number of records in the chunk
+    unsigned long count;
+};
+
+/// Classic PCAP file mapped to memory. Record headers are walked directly
+/// in the mapping and packets are handed out without copying.
+class PcapMapping
+{
+private:
+    void *mapping;
+    const unsigned char *data;
+    size_t size;
+    size_t pos;
+    bool swapped;
+    bool nsec;
+    struct pcap_pkthdr header;
+    /// copy of a record close to the end of the mapping, get_payload may
+    /// read headers beyond the captured data
+    std::vector<unsigned char> tail;
+
+    uint32_t read32(size_t offset) const
+    {
+        uint32_t x;
+        memcpy(&x, data + offset, sizeof(x));
+        return swapped ? __builtin_bswap32(x) : x;
+    }
+
+public:
+    /// size of the global header of PCAP file
+    static const size_t global_hdr_size = 24;
+    /// size of the record header of PCAP file
+    static const size_t record_hdr_size = 16;
+    /// records closer to the end of the mapping are copied
+    static const size_t tail_size = 256;
+
+    /// Maps the file, it is not valid if it is not a classic PCAP file.
+    /// @param capturefile filename of PCAP file
+    /// @param populate read the whole file ahead, set unless only a part of
+    /// the file is processed
+    PcapMapping(const char* capturefile, bool populate = true) :
+        mapping{nullptr}, data{nullptr}, size{0}, pos{global_hdr_size},
+        swapped{false}, nsec{false}
+    {
+        int fd = open(capturefile, O_RDONLY);
+        if (fd == -1) {
+            throw std::ios_base::failure(
+                "cannot open pcap file '" + std::string(capturefile) + "'");
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == -1 ||
+            static_cast<size_t>(st.st_size) < global_hdr_size)
+        {
+            close(fd);
+            return;
+        }
+
+        void *addr = mmap(
+            nullptr, st.st_size, PROT_READ,
+            MAP_PRIVATE | (populate ? MAP_POPULATE : 0), fd, 0);
+        close(fd);
+        if (addr == MAP_FAILED) {
+            return;
+        }
+
+        mapping = addr;
+        data = static_cast<const unsigned char*>(addr);
+        size = st.st_size;
+        madvise(mapping, size, MADV_SEQUENTIAL);
+
+        // microsecond and nanosecond magic in both byte orders
+        uint32_t magic = read32(0);
+        swapped = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+        nsec = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+        if (!swapped && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) {
+            munmap(mapping, size);
+            mapping = nullptr;
+        }
+    }
+
+    PcapMapping(const PcapMapping &) = delete;
+    PcapMapping &operator=(const PcapMapping &) = delete;
+
+    ~PcapMapping()
+    {
+        if (mapping)
+            munmap(mapping, size);
+    }
+
+    /// @return true if the file is mapped classic PCAP file
+    bool is_valid() const { return mapping != nullptr;}
+
+    /// @return true if the packet points to the mapping, i.e. it stays
+    /// valid after reading other records
+    bool is_mapped(const unsigned char *packet) const
+    {
+        return packet >= data && packet < data + size;
+    }
+
+    /// Moves to the record at the offset, 0 means the first record.
+    void seek(size_t offset)
+    {
+        pos = offset ? offset : global_hdr_size;
+    }
+
+    /// Reads the next record.
+    /// @param hdr header of the record
+    /// @param packet captured data of the record
+    /// @return false at the end of the file or of a truncated record
+    bool next(const struct pcap_pkthdr *&hdr, const unsigned char *&packet)
+    {
+        if (pos + record_hdr_size > size)
+            return false;
+
+        header.ts.tv_sec = read32(pos);
+        header.ts.tv_usec = nsec ? read32(pos + 4) / 1000 : read32(pos + 4);
+        header.caplen = read32(pos + 8);
+        header.len = read32(pos + 12);
+        pos += record_hdr_size;
+        if (header.caplen > size - pos)
+            return false;
+
+        packet = data + pos;
+        pos += header.caplen;
+        if (size - pos < tail_size) {
+            tail.assign(header.caplen + tail_size, 0);
+            memcpy(tail.data(), packet, header.caplen);
+            packet = tail.data();
+        }
+
+        hdr = &header;
+        return true;
+    }
+};
+
+/// Directional flow identifier, IPv4 addresses are stored as IPv4-mapped
+/// IPv6 addresses.
+struct FlowKey
+{
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t proto;
+
+    bool operator==(const FlowKey &key) const
+    {
+        return !memcmp(this, &key, sizeof(FlowKey));
+    }
+};
+
+struct FlowKeyHash
+{
+    size_t operator()(const FlowKey &key) const
+    {
+        // FNV-1a
+        const uint8_t *p = reinterpret_cast<const uint8_t*>(&key);
+        size_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < sizeof(key); i++)
+            h = (h ^ p[i]) * 1099511628211ULL;
+        return h;
+    }
+};
+
+/// Header fields of a packet, which are needed to follow flows.
+struct PacketInfo
+{
+    FlowKey flow;
+    uint32_t seq;       // TCP sequence number
+    uint8_t tcp_flags;  // TCP flags, 0 if it is not TCP packet
+    double time;        // capture time in seconds
+};
+
 static inline const unsigned char *get_payload(
     const unsigned char *packet,
-    const struct pcap_pkthdr *header);
+    const struct pcap_pkthdr *header, PacketInfo *info = nullptr);
 
 
 template<typename F>
@@ -47,6 +511,49 @@ pcap_t* init_pcap(const char* capturefile);
 template<typename F>
 pcap_t* process_payload(pcap_t *pcap, F func, unsigned long count = ~0UL);
 
+template<typename F>
+pcap_t* process_payload_batch(
+    const char* capturefile, F func, size_t batch_size,
+    unsigned long count = ~0UL);
+
+template<typename F>
+pcap_t* process_payload_batch(
+    pcap_t *pcap, F func, size_t batch_size, unsigned long count = ~0UL);
+
+template<typename F>
+void process_payload_mmap(
+    const char* capturefile, F func, unsigned long count = ~0UL);
+
+template<typename F>
+void process_payload_mmap_batch(
+    const char* capturefile, F func, size_t batch_size,
+    unsigned long count = ~0UL);
+
+template<typename F>
+void process_flow_payload(
+    const char* capturefile, F func, unsigned long count = ~0UL);
+
+inline std::vector<PcapChunk> index_pcap(
+    const char* capturefile, unsigned long chunk_size);
+
+class ChunkReader;
+
+template<typename F>
+void process_payload_chunk(ChunkReader &reader, const PcapChunk &chunk, F func);
+
+template<typename F>
+void process_payload_chunk_batch(
+    ChunkReader &reader, const PcapChunk &chunk, F func, size_t batch_size);
+
+template<typename F>
+void process_flow_payload_chunk(
+    ChunkReader &reader, const PcapChunk &chunk, F func);
+
+template<typename F>
+void process_corpus_batch(
+    const PayloadCorpus &corpus, uint64_t first, unsigned long count, F func,
+    size_t batch_size);
+
 /// Generic function for processing packet payload.
 ///
 /// @param capturefile filename of PCAP file
@@ -101,11 +608,551 @@ pcap_t* process_payload(pcap_t *pcap, F func, unsigned long count)
     }
 }
 
+/// Generic function for processing payloads of several packets at once.
+///
+/// @param capturefile filename of PCAP file
+/// @param func lambda function which manipulates with PayloadBatch
+/// @param batch_size max. number of payloads in one batch
+/// @param count Total number of processed packets, which includes some
+/// payload data.
+template<typename F>
+pcap_t* process_payload_batch(
+    const char* capturefile, F func, size_t batch_size, unsigned long count)
+{
+    char err_buf[4096] = "";
+    pcap_t *pcap;
+
+    if (!(pcap = pcap_open_offline(capturefile, err_buf)))
+    {
+        throw std::ios_base::failure(
+            "cannot open pcap file '" + std::string(capturefile) + "'");
+    }
+
+    return process_payload_batch(pcap, func, batch_size, count);
+}
+
+/// Generic function for processing payloads of several packets at once.
+///
+/// @param pcap PCAP file pointer
+/// @param func lambda function which manipulates with PayloadBatch
+/// @param batch_size max. number of payloads in one batch
+/// @param count Total number of processed packets, which includes some
+/// payload data.
+template<typename F>
+pcap_t* process_payload_batch(
+    pcap_t *pcap, F func, size_t batch_size, unsigned long count)
+{
+    PayloadBatch batch;
+    auto ret = process_payload(
+        pcap,
+        [&] (const unsigned char *payload, unsigned len)
+        {
+            batch.push(payload, len);
+            if (batch.size() == batch_size) {
+                batch.finish();
+                func(batch);
+                batch.clear();
+            }
+        }, count);
+
+    if (!batch.empty()) {
+        batch.finish();
+        func(batch);
+    }
+
+    return ret;
+}
+
+/// Splits PCAP file into chunks of packet records, only the record headers
+/// are read. Captures in other formats than classic PCAP (e.g. pcapng) are
+/// returned as a single chunk. A corpus is split into ranges of payloads.
+///
+/// @param capturefile filename of PCAP file or corpus
+/// @param chunk_size max. number of records in one chunk
+/// @return chunks in the order of the capture
+inline std::vector<PcapChunk> index_pcap(
+    const char* capturefile, unsigned long chunk_size)
+{
+    if (PayloadCorpus::is_corpus(capturefile)) {
+        PayloadCorpus corpus(capturefile, false);
+        std::vector<PcapChunk> chunks;
+        for (uint64_t i = 0; i < corpus.size(); i += chunk_size) {
+            chunks.push_back(PcapChunk{
+                static_cast<long>(i),
+                std::min<unsigned long>(chunk_size, corpus.size() - i)});
+        }
+        return chunks;
+    }
+
+    FILE *f = fopen(capturefile, "rb");
+    if (!f) {
+        throw std::ios_base::failure(
+            "cannot open pcap file '" + std::string(capturefile) + "'");
+    }
+
+    uint32_t global_hdr[6];
+    std::vector<PcapChunk> chunks;
+    if (fread(global_hdr, sizeof(global_hdr), 1, f) != 1) {
+        fclose(f);
+        throw std::ios_base::failure(
+            "invalid pcap file '" + std::string(capturefile) + "'");
+    }
+
+    // microsecond and nanosecond magic in both byte orders
+    uint32_t magic = global_hdr[0];
+    bool swapped = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    if (!swapped && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) {
+        fclose(f);
+        chunks.push_back(PcapChunk{0, ~0UL});
+        return chunks;
+    }
+
+    long offset = sizeof(global_hdr);
+    uint32_t record_hdr[4];
+    unsigned long count = 0;
+    while (fread(record_hdr, sizeof(record_hdr), 1, f) == 1) {
+        if (count == 0) {
+            chunks.push_back(PcapChunk{offset, 0});
+        }
+        uint32_t caplen = swapped ?
+            __builtin_bswap32(record_hdr[2]) : record_hdr[2];
+        offset += sizeof(record_hdr) + caplen;
+        if (fseek(f, offset, SEEK_SET)) {
+            break;
+        }
+        chunks.back().count++;
+        count = (count + 1) % chunk_size;
+    }
+
+    fclose(f);
+    return chunks;
+}
+
+/// Opens PCAP file positioned at the beginning of the chunk.
+static inline pcap_t *open_pcap_chunk(
+    const char* capturefile, const PcapChunk &chunk)
+{
+    char err_buf[4096] = "";
+    pcap_t *pcap;
+
+    if (!(pcap = pcap_open_offline(capturefile, err_buf)))
+    {
+        throw std::ios_base::failure(
+            "cannot open pcap file '" + std::string(capturefile) + "'");
+    }
+
+    if (chunk.offset && fseek(pcap_file(pcap), chunk.offset, SEEK_SET))
+    {
+        pcap_close(pcap);
+        throw std::ios_base::failure(
+            "cannot seek in pcap file '" + std::string(capturefile) + "'");
+    }
+
+    return pcap;
+}
+
+/// PCAP file or corpus opened once and read chunk by chunk, so that
+/// a thread processing many chunks of the file does not open and map it for
+/// each of them. Classic PCAP files and corpora are mapped to memory, other
+/// files are read by libpcap. The reader keeps the position of the last
+/// chunk, so each thread needs its own reader.
+class ChunkReader
+{
+private:
+    std::string capturefile;
+    std::unique_ptr<PayloadCorpus> corpus;
+    std::unique_ptr<PcapMapping> mapping;
+    pcap_t *pcap;
+    /// position of the first record in the file read by libpcap
+    long start;
+
+public:
+    /// @param capturefile filename of PCAP file or corpus
+    ChunkReader(const char *capturefile) :
+        capturefile{capturefile}, pcap{nullptr}, start{0}
+    {
+        if (PayloadCorpus::is_corpus(capturefile)) {
+            corpus.reset(new PayloadCorpus(capturefile, false));
+            return;
+        }
+
+        mapping.reset(new PcapMapping(capturefile, false));
+        if (!mapping->is_valid()) {
+            mapping.reset();
+            pcap = open_pcap_chunk(capturefile, PcapChunk{0, 0});
+            start = ftell(pcap_file(pcap));
+        }
+    }
+
+    ChunkReader(const ChunkReader &) = delete;
+    ChunkReader &operator=(const ChunkReader &) = delete;
+
+    ~ChunkReader()
+    {
+        if (pcap)
+            pcap_close(pcap);
+    }
+
+    /// @return the corpus, or nullptr if the file is a PCAP file
+    const PayloadCorpus *get_corpus() const { return corpus.get();}
+
+    /// @return the mapping moved to the chunk, or nullptr if the file is
+    /// not a mapped classic PCAP file
+    PcapMapping *seek_mapping(const PcapChunk &chunk)
+    {
+        if (mapping)
+            mapping->seek(chunk.offset);
+        return mapping.get();
+    }
+
+    /// @return libpcap handle moved to the chunk
+    pcap_t *seek_pcap(const PcapChunk &chunk)
+    {
+        if (fseek(pcap_file(pcap), chunk.offset ? chunk.offset : start,
+            SEEK_SET))
+        {
+            throw std::ios_base::failure(
+                "cannot seek in pcap file '" + capturefile + "'");
+        }
+        return pcap;
+    }
+};
+
+/// Generic function for processing packet payload, classic PCAP files are
+/// mapped to memory and payloads are not copied. Other files are read by
+/// libpcap. Each distinct payload of a corpus is passed once, use
+/// process_payload_mmap_batch to get the number of its packets.
+///
+/// @param capturefile filename of PCAP file or corpus
+/// @param func lambda function which manipulates with packet payload
+/// @param count Total number of processed packets, which includes some
+/// payload data.
+template<typename F>
+void process_payload_mmap(
+    const char* capturefile, F func, unsigned long count)
+{
+    if (PayloadCorpus::is_corpus(capturefile)) {
+        PayloadCorpus corpus(capturefile);
+        for (uint64_t i = 0; i < corpus.size() && count; i++, count--)
+            func(corpus.payload(i), corpus.length(i));
+        return;
+    }
+
+    PcapMapping pcap(capturefile);
+    if (!pcap.is_valid()) {
+        process_payload(capturefile, func, count);
+        return;
+    }
+
+    const struct pcap_pkthdr *header;
+    const unsigned char *packet, *payload;
+
+    while (count && pcap.next(header, packet))
+    {
+        payload = get_payload(packet, header);
+        int len = header->caplen - (payload - packet);
+        if (len > 0) {
+            count--;
+            func(payload, len);
+        }
+    }
+}
+
+/// Generic function for processing payloads of several packets at once,
+/// classic PCAP files are mapped to memory and payloads are not copied.
+/// Payloads of a corpus are passed with the number of their packets.
+///
+/// @param capturefile filename of PCAP file or corpus
+/// @param func lambda function which manipulates with PayloadBatch
+/// @param batch_size max. number of payloads in one batch
+/// @param count Total number of processed packets, which includes some
+/// payload data, or of distinct payloads of a corpus.
+template<typename F>
+void process_payload_mmap_batch(
+    const char* capturefile, F func, size_t batch_size, unsigned long count)
+{
+    if (PayloadCorpus::is_corpus(capturefile)) {
+        PayloadCorpus corpus(capturefile);
+        process_corpus_batch(corpus, 0, count, func, batch_size);
+        return;
+    }
+
+    PcapMapping pcap(capturefile);
+    if (!pcap.is_valid()) {
+        process_payload_batch(capturefile, func, batch_size, count);
+        return;
+    }
+
+    PayloadBatch batch;
+    const struct pcap_pkthdr *header;
+    const unsigned char *packet, *payload;
+
+    while (count && pcap.next(header, packet))
+    {
+        payload = get_payload(packet, header);
+        int len = header->caplen - (payload - packet);
+        if (len <= 0)
+            continue;
+
+        count--;
+        if (pcap.is_mapped(payload))
+            batch.push_ref(payload, len);
+        else
+            batch.push(payload, len);
+
+        if (batch.size() == batch_size) {
+            batch.finish();
+            func(batch);
+            batch.clear();
+        }
+    }
+
+    if (!batch.empty()) {
+        batch.finish();
+        func(batch);
+    }
+}
+
+/// Generic function for processing packet payload together with flow
+/// information. Besides packets with payload, TCP packets opening or closing
+/// connection are passed with empty payload.
+///
+/// @param capturefile filename of PCAP file
+/// @param func lambda function which manipulates with PacketInfo and packet
+/// payload
+/// @param count Total number of processed packets, which includes some
+/// payload data.
+template<typename F>
+void process_flow_payload(
+    const char* capturefile, F func, unsigned long count)
+{
+    PacketInfo info;
+    auto process = [&] (
+        const unsigned char *packet, const struct pcap_pkthdr *header)
+    {
+        auto payload = get_payload(packet, header, &info);
+        int len = header->caplen - (payload - packet);
+        if (len > 0) {
+            count--;
+            func(info, payload, len);
+        }
+        else if (info.tcp_flags & (TH_SYN | TH_FIN | TH_RST)) {
+            func(info, payload, 0);
+        }
+    };
+
+    PcapMapping mapping(capturefile);
+    const struct pcap_pkthdr *header;
+    const unsigned char *packet;
+
+    if (mapping.is_valid()) {
+        while (count && mapping.next(header, packet))
+            process(packet, header);
+        return;
+    }
+
+    char err_buf[4096] = "";
+    pcap_t *pcap;
+    struct pcap_pkthdr *pcap_header;
+
+    if (!(pcap = pcap_open_offline(capturefile, err_buf)))
+    {
+        throw std::ios_base::failure(
+            "cannot open pcap file '" + std::string(capturefile) + "'");
+    }
+
+    while (count && pcap_next_ex(pcap, &pcap_header, &packet) == 1)
+        process(packet, pcap_header);
+
+    pcap_close(pcap);
+}
+
+/// Generic function for processing packet payloads of one chunk.
+///
+/// @param reader opened PCAP file
+/// @param chunk chunk of PCAP file obtained by index_pcap
+/// @param func lambda function which manipulates with packet payload
+template<typename F>
+void process_payload_chunk(ChunkReader &reader, const PcapChunk &chunk, F func)
+{
+    process_payload_chunk_batch(
+        reader, chunk,
+        [&func] (const PayloadBatch &batch)
+        {
+            for (size_t i = 0; i < batch.size(); i++)
+                func(batch.payloads[i], batch.lengths[i]);
+        }, 1);
+}
+
+/// Generic function for processing payloads of one chunk, several payloads
+/// at once. Classic PCAP files and corpora are mapped to memory and payloads
+/// are not copied.
+///
+/// @param reader opened PCAP file or corpus
+/// @param chunk chunk of PCAP file obtained by index_pcap
+/// @param func lambda function which manipulates with PayloadBatch
+/// @param batch_size max. number of payloads in one batch
+template<typename F>
+void process_payload_chunk_batch(
+    ChunkReader &reader, const PcapChunk &chunk, F func, size_t batch_size)
+{
+    if (auto corpus = reader.get_corpus()) {
+        process_corpus_batch(
+            *corpus, chunk.offset, chunk.count, func, batch_size);
+        return;
+    }
+
+    PayloadBatch batch;
+    auto add_payload = [&] (
+        const unsigned char *payload, unsigned len, bool mapped)
+    {
+        if (mapped)
+            batch.push_ref(payload, len);
+        else
+            batch.push(payload, len);
+
+        if (batch.size() == batch_size) {
+            batch.finish();
+            func(batch);
+            batch.clear();
+        }
+    };
+
+    const struct pcap_pkthdr *header;
+    struct pcap_pkthdr *pcap_header;
+    const unsigned char *packet, *payload;
+
+    if (auto mapping = reader.seek_mapping(chunk)) {
+        for (unsigned long n = chunk.count;
+            n && mapping->next(header, packet); n--)
+        {
+            payload = get_payload(packet, header);
+            int len = header->caplen - (payload - packet);
+            if (len > 0) {
+                add_payload(payload, len, mapping->is_mapped(payload));
+            }
+        }
+    }
+    else {
+        pcap_t *pcap = reader.seek_pcap(chunk);
+        for (unsigned long n = chunk.count;
+            n && pcap_next_ex(pcap, &pcap_header, &packet) == 1; n--)
+        {
+            payload = get_payload(packet, pcap_header);
+            int len = pcap_header->caplen - (payload - packet);
+            if (len > 0) {
+                add_payload(payload, len, false);
+            }
+        }
+    }
+
+    if (!batch.empty()) {
+        batch.finish();
+        func(batch);
+    }
+}
+
+/// Generic function for processing payloads of a corpus, several payloads
+/// at once. Payloads are not copied and each of them is passed with the
+/// number of its packets, see PayloadBatch::count.
+///
+/// @param corpus corpus of payloads
+/// @param first index of the first payload
+/// @param count max. number of payloads
+/// @param func lambda function which manipulates with PayloadBatch
+/// @param batch_size max. number of payloads in one batch
+template<typename F>
+void process_corpus_batch(
+    const PayloadCorpus &corpus, uint64_t first, unsigned long count, F func,
+    size_t batch_size)
+{
+    PayloadBatch batch;
+    uint64_t last = first + std::min<uint64_t>(
+        count, corpus.size() - std::min(first, corpus.size()));
+    for (uint64_t i = first; i < last; i++) {
+        batch.push_corpus(corpus, i);
+        if (batch.size() == batch_size) {
+            batch.finish();
+            func(batch);
+            batch.clear();
+        }
+    }
+
+    if (!batch.empty()) {
+        batch.finish();
+        func(batch);
+    }
+}
+
+/// Generic function for processing payloads of one chunk together with flow
+/// information, packets are passed as by process_flow_payload.
+///
+/// @param reader opened PCAP file
+/// @param chunk chunk of PCAP file obtained by index_pcap
+/// @param func lambda function which manipulates with PacketInfo and packet
+/// payload
+template<typename F>
+void process_flow_payload_chunk(
+    ChunkReader &reader, const PcapChunk &chunk, F func)
+{
+    PacketInfo info;
+    auto process = [&] (
+        const unsigned char *packet, const struct pcap_pkthdr *header)
+    {
+        auto payload = get_payload(packet, header, &info);
+        int len = header->caplen - (payload - packet);
+        if (len > 0) {
+            func(info, payload, len);
+        }
+        else if (info.tcp_flags & (TH_SYN | TH_FIN | TH_RST)) {
+            func(info, payload, 0);
+        }
+    };
+
+    const struct pcap_pkthdr *header;
+    struct pcap_pkthdr *pcap_header;
+    const unsigned char *packet;
+
+    if (auto mapping = reader.seek_mapping(chunk)) {
+        for (unsigned long n = chunk.count;
+            n && mapping->next(header, packet); n--)
+        {
+            process(packet, header);
+        }
+    }
+    else {
+        pcap_t *pcap = reader.seek_pcap(chunk);
+        for (unsigned long n = chunk.count;
+            n && pcap_next_ex(pcap, &pcap_header, &packet) == 1; n--)
+        {
+            process(packet, pcap_header);
+        }
+    }
+}
+
+/// Stores IPv4 address as IPv4-mapped IPv6 address.
+static inline void map_ipv4(uint8_t *dst, const in_addr &addr)
+{
+    memset(dst, 0, 10);
+    dst[10] = dst[11] = 0xff;
+    memcpy(dst + 12, &addr, 4);
+}
+
 /// Extract payload from packet
+/// @param packet captured packet
+/// @param header PCAP header of the packet
+/// @param info if set, header fields of the packet are stored to it
 inline const unsigned char *get_payload(
     const unsigned char *packet,
-    const struct pcap_pkthdr *header)
+    const struct pcap_pkthdr *header, PacketInfo *info)
 {
+    if (info) {
+        memset(&info->flow, 0, sizeof(info->flow));
+        info->seq = 0;
+        info->tcp_flags = 0;
+        info->time = header->ts.tv_sec + header->ts.tv_usec * 1e-6;
+    }
+
     const unsigned char *packet_end = packet + header->caplen;
     size_t offset = sizeof(ether_header);
     const ether_header* eth_hdr = reinterpret_cast<const ether_header*>(packet);
@@ -126,6 +1173,10 @@ inline const unsigned char *get_payload(
         const ip* ip_hdr = reinterpret_cast<const ip*>(packet + offset);
         offset += sizeof(ip);
         l4_proto = ip_hdr->ip_p;
+        if (info) {
+            map_ipv4(info->flow.src, ip_hdr->ip_src);
+            map_ipv4(info->flow.dst, ip_hdr->ip_dst);
+        }
     }
     else if (ETHERTYPE_IPV6 == ether_type)
     {
@@ -134,6 +1185,10 @@ inline const unsigned char *get_payload(
 
         offset += sizeof(ip6_hdr);
         l4_proto = ip_hdr->ip6_nxt;
+        if (info) {
+            memcpy(info->flow.src, &ip_hdr->ip6_src, 16);
+            memcpy(info->flow.dst, &ip_hdr->ip6_dst, 16);
+        }
     }
     else
     {
@@ -150,16 +1205,34 @@ inline const unsigned char *get_payload(
 
             size_t tcp_hdr_size = tcp_hdr->th_off * 4;
             offset += tcp_hdr_size;
+            if (info) {
+                info->flow.sport = ntohs(tcp_hdr->th_sport);
+                info->flow.dport = ntohs(tcp_hdr->th_dport);
+                info->flow.proto = l4_proto;
+                info->seq = ntohl(tcp_hdr->th_seq);
+                info->tcp_flags = tcp_hdr->th_flags;
+            }
         }
         else if (IPPROTO_UDP == l4_proto)
         {
+            const udphdr* udp_hdr =
+            reinterpret_cast<const udphdr*>(packet + offset);
             offset += sizeof(udphdr);
+            if (info) {
+                info->flow.sport = ntohs(udp_hdr->uh_sport);
+                info->flow.dport = ntohs(udp_hdr->uh_dport);
+                info->flow.proto = l4_proto;
+            }
         }
         else if (IPPROTO_IPIP == l4_proto)
         {
             const ip* ip_hdr = reinterpret_cast<const ip*>(packet + offset);
             offset += sizeof(ip);
             l4_proto = ip_hdr->ip_p;
+            if (info) {
+                map_ipv4(info->flow.src, ip_hdr->ip_src);
+                map_ipv4(info->flow.dst, ip_hdr->ip_dst);
+            }
             cond = true;
         }
         else if (IPPROTO_ESP == l4_proto)
@@ -188,6 +1261,10 @@ inline const unsigned char *get_payload(
             reinterpret_cast<const ip6_hdr*>(packet + offset);
             offset += sizeof(ip6_hdr);
             l4_proto = ip_hdr->ip6_nxt;
+            if (info) {
+                memcpy(info->flow.src, &ip_hdr->ip6_src, 16);
+                memcpy(info->flow.dst, &ip_hdr->ip6_dst, 16);
+            }
         }
         else
         {
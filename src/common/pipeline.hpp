@@ -0,0 +1,329 @@
+/// @author Jakub Semric
+/// 2018
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "pcap_reader.hpp"
+
+namespace pcapreader
+{
+
+/// Bounded lock-free queue with a single producer and multiple consumers.
+/// Each cell carries a sequence number telling whether it is free for the
+/// producer or full for consumers.
+template<typename T>
+class SpmcRing
+{
+private:
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    // consumers and producer positions are kept on separate cache lines
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) size_t tail;
+    std::atomic<bool> closed;
+
+public:
+    /// @param capacity max. number of items, rounded up to the power of two
+    SpmcRing(size_t capacity) : head{0}, tail{0}, closed{false}
+    {
+        size_t size = 1;
+        while (size < capacity)
+            size *= 2;
+
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++)
+            cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    size_t capacity() const { return mask + 1;}
+
+    /// Approximate number of items, exact if called by the producer while
+    /// consumers are idle.
+    size_t size() const
+    {
+        return tail - head.load(std::memory_order_relaxed);
+    }
+
+    /// Called by the producer only.
+    /// @return false if the ring is full
+    bool try_push(T &value)
+    {
+        Cell &cell = cells[tail & mask];
+        if (cell.seq.load(std::memory_order_acquire) != tail)
+            return false;
+
+        cell.value = std::move(value);
+        cell.seq.store(tail + 1, std::memory_order_release);
+        tail++;
+        return true;
+    }
+
+    /// Called by consumers.
+    /// @return false if the ring is empty
+    bool try_pop(T &value)
+    {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[pos & mask];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            if (seq == pos + 1) {
+                if (head.compare_exchange_weak(
+                    pos, pos + 1, std::memory_order_relaxed))
+                {
+                    value = std::move(cell.value);
+                    cell.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (seq == pos) {
+                return false;
+            }
+            else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// No more items will be pushed.
+    void close() { closed.store(true, std::memory_order_release);}
+
+    bool is_closed() const { return closed.load(std::memory_order_acquire);}
+};
+
+/// Throughput and waiting of the reader and matcher stages of the pipeline.
+struct PipelineCounters
+{
+    size_t packets;         // payloads passed through the pipeline
+    size_t batches;         // batches passed through the pipeline
+    size_t capacity;        // capacity of the ring in batches
+    double reader_time;     // total time of the reader in seconds
+    double reader_wait;     // time the reader waited for a free cell
+    double matcher_time;    // total time of all matchers in seconds
+    double matcher_wait;    // time matchers waited for a batch
+    size_t occupancy;       // sum of ring sizes sampled by the reader
+    size_t samples;         // number of samples of ring size
+
+    PipelineCounters() :
+        packets{0}, batches{0}, capacity{0}, reader_time{0}, reader_wait{0},
+        matcher_time{0}, matcher_wait{0}, occupancy{0}, samples{0} {}
+
+    /// Prints throughput of each stage when it is not waiting for the other
+    /// one, the slower stage is the bottleneck.
+    void print(std::ostream &out = std::cerr) const
+    {
+        double reader_busy = reader_time - reader_wait;
+        double matcher_busy = matcher_time - matcher_wait;
+        out << "reader    : " << (reader_busy > 0 ? packets / reader_busy : 0)
+            << " pkts/s, waiting " << 100 * reader_wait / reader_time
+            << "%\n";
+        out << "matchers  : "
+            << (matcher_busy > 0 ? packets / matcher_busy : 0)
+            << " pkts/s per matcher, waiting "
+            << 100 * matcher_wait / matcher_time << "%\n";
+        out << "ring      : " << (samples ? occupancy * 1.0 / samples : 0)
+            << "/" << capacity << " batches occupied in average\n";
+    }
+};
+
+/// Batch of payloads of one PCAP file passed through the pipeline.
+struct PipelineBatch
+{
+    size_t pcap;            // index of PCAP file
+    PayloadBatch payloads;
+};
+
+/// Processes payloads in two stages running in parallel. The calling thread
+/// reads PCAP files and extracts payloads into batches, which are passed
+/// through a lock-free ring to matcher threads. Classic PCAP files and
+/// corpora are mapped to memory and stay mapped until all batches are
+/// processed.
+///
+/// @param pcaps filenames of PCAP files, read in the given order
+/// @param func lambda function called by matchers with the matcher number,
+/// index of PCAP file and PayloadBatch
+/// @param nmatchers number of matcher threads
+/// @param batch_size max. number of payloads in one batch
+/// @param max_count max. number of processed packets with payload of each PCAP
+/// file
+/// @param counters if set, pipeline counters are added to it
+template<typename F>
+void process_payload_pipeline(
+    const std::vector<std::string> &pcaps, F func, unsigned nmatchers,
+    size_t batch_size, unsigned long max_count = ~0UL,
+    PipelineCounters *counters = nullptr)
+{
+    typedef std::chrono::steady_clock clock;
+    auto seconds = [](clock::duration d) {
+        return std::chrono::duration<double>(d).count();
+    };
+
+    SpmcRing<PipelineBatch> ring(4 * nmatchers);
+    std::atomic<bool> failed{false};
+    std::vector<double> matcher_time(nmatchers), matcher_wait(nmatchers);
+    // declared before the matchers, so that they are unmapped only after all
+    // matchers finished, even if an exception is thrown
+    std::vector<std::unique_ptr<PcapMapping>> mappings;
+    std::vector<std::unique_ptr<PayloadCorpus>> corpora;
+    std::vector<std::future<void>> matchers;
+
+    for (unsigned i = 0; i < nmatchers; i++) {
+        matchers.push_back(std::async(std::launch::async, [&, i] () {
+            auto start = clock::now();
+            clock::duration wait{0};
+            PipelineBatch batch;
+            try {
+                while (!failed) {
+                    if (ring.try_pop(batch)) {
+                        func(i, batch.pcap, batch.payloads);
+                        continue;
+                    }
+                    // the ring is closed before the last push is seen
+                    bool closed = ring.is_closed();
+                    if (ring.try_pop(batch)) {
+                        func(i, batch.pcap, batch.payloads);
+                        continue;
+                    }
+                    if (closed)
+                        break;
+
+                    auto wait_start = clock::now();
+                    std::this_thread::yield();
+                    wait += clock::now() - wait_start;
+                }
+            }
+            catch (...) {
+                failed = true;
+                throw;
+            }
+            matcher_time[i] = seconds(clock::now() - start);
+            matcher_wait[i] = seconds(wait);
+        }));
+    }
+
+    auto start = clock::now();
+    clock::duration wait{0};
+    size_t packets = 0, batches = 0, occupancy = 0;
+    PipelineBatch batch;
+
+    auto push = [&] () {
+        batch.payloads.finish();
+        occupancy += ring.size();
+        batches++;
+        while (!ring.try_push(batch) && !failed) {
+            auto wait_start = clock::now();
+            std::this_thread::yield();
+            wait += clock::now() - wait_start;
+        }
+        batch.payloads.clear();
+    };
+
+    try {
+        for (size_t p = 0; p < pcaps.size() && !failed; p++) {
+            unsigned long count = max_count;
+            batch.pcap = p;
+            if (PayloadCorpus::is_corpus(pcaps[p].c_str())) {
+                corpora.emplace_back(new PayloadCorpus(pcaps[p].c_str()));
+                auto &corpus = *corpora.back();
+                for (uint64_t i = 0; i < corpus.size() && count && !failed;
+                    i++, count--)
+                {
+                    packets++;
+                    batch.payloads.push_corpus(corpus, i);
+                    if (batch.payloads.size() == batch_size)
+                        push();
+                }
+                if (!batch.payloads.empty())
+                    push();
+                continue;
+            }
+
+            mappings.emplace_back(new PcapMapping(pcaps[p].c_str()));
+            auto &mapping = *mappings.back();
+            const struct pcap_pkthdr *header;
+            const unsigned char *packet, *payload;
+
+            auto add = [&] (const unsigned char *payload, unsigned len) {
+                count--;
+                packets++;
+                if (mapping.is_mapped(payload))
+                    batch.payloads.push_ref(payload, len);
+                else
+                    batch.payloads.push(payload, len);
+
+                if (batch.payloads.size() == batch_size)
+                    push();
+            };
+
+            if (mapping.is_valid()) {
+                while (count && !failed && mapping.next(header, packet)) {
+                    payload = get_payload(packet, header);
+                    int len = header->caplen - (payload - packet);
+                    if (len > 0)
+                        add(payload, len);
+                }
+            }
+            else {
+                auto pcap = process_payload(pcaps[p].c_str(), add, count);
+                if (pcap)
+                    pcap_close(pcap);
+            }
+
+            if (!batch.payloads.empty())
+                push();
+        }
+    }
+    catch (...) {
+        failed = true;
+        ring.close();
+        throw;
+    }
+
+    ring.close();
+    double reader_time = seconds(clock::now() - start);
+    // all matchers are waited for before the first exception is rethrown
+    std::exception_ptr error;
+    for (auto &i : matchers) {
+        try {
+            i.get();
+        }
+        catch (...) {
+            if (!error)
+                error = std::current_exception();
+        }
+    }
+    if (error)
+        std::rethrow_exception(error);
+
+    if (counters) {
+        counters->packets += packets;
+        counters->batches += batches;
+        counters->capacity = ring.capacity();
+        counters->reader_time += reader_time;
+        counters->reader_wait += seconds(wait);
+        for (unsigned i = 0; i < nmatchers; i++) {
+            counters->matcher_time += matcher_time[i];
+            counters->matcher_wait += matcher_wait[i];
+        }
+        counters->occupancy += occupancy;
+        counters->samples += batches;
+    }
+}
+
+}  // end of namespace
@@ -0,0 +1,63 @@
+/// @author Jakub Semric
+/// 2018
+
+#include "prefix_set.hpp"
+
+namespace reduction
+{
+
+const size_t PrefixSet::block_size;
+
+size_t PrefixSet::push_back(uint64_t value)
+{
+    size_t before = memory();
+    uint64_t delta = value - last;
+    while (delta >= 0x80) {
+        data.push_back(static_cast<uint8_t>(delta) | 0x80);
+        delta >>= 7;
+    }
+    data.push_back(static_cast<uint8_t>(delta));
+
+    if (count % block_size == 0)
+        skips.push_back(Skip{value, data.size()});
+
+    last = value;
+    count++;
+    return memory() - before;
+}
+
+size_t PrefixSet::append(const PrefixSet &other, uint64_t offset)
+{
+    size_t added = 0;
+    other.for_each([&](uint64_t value) { added += push_back(value + offset);});
+    return added;
+}
+
+/// Counts common values of two sets. The reader of the set which is behind
+/// seeks to the value of the other one, skipping whole blocks if the sets
+/// differ a lot in size.
+size_t PrefixSet::intersection_count(const PrefixSet &a, const PrefixSet &b)
+{
+    if (a.empty() || b.empty())
+        return 0;
+
+    size_t cnt = 0;
+    Reader i(a), j(b);
+    while (i.valid() && j.valid()) {
+        if (i.value < j.value) {
+            i.seek(j.value);
+        }
+        else if (j.value < i.value) {
+            j.seek(i.value);
+        }
+        else {
+            cnt++;
+            i.next();
+            j.next();
+        }
+    }
+
+    return cnt;
+}
+
+}
@@ -0,0 +1,134 @@
+/// @author Jakub Semric
+/// 2018
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+namespace reduction
+{
+
+using namespace std;
+
+/// Compressed sorted set of prefix numbers. Values are appended in increasing
+/// order and stored as varint encoded differences, usually one or two bytes
+/// per value instead of eight. Every block_size values a skip entry is
+/// stored, so that intersection can skip whole blocks.
+class PrefixSet
+{
+private:
+    struct Skip
+    {
+        uint64_t value;     // first value of the block
+        uint64_t offset;    // position following the encoded value
+    };
+
+    vector<uint8_t> data;
+    vector<Skip> skips;
+    uint64_t last;
+    size_t count;
+
+    static const size_t block_size = 64;
+
+    /// Decodes values of the set, can jump over blocks.
+    class Reader
+    {
+    private:
+        const PrefixSet &set;
+        size_t pos;
+        size_t index;
+        size_t skip;
+
+    public:
+        uint64_t value;
+
+        Reader(const PrefixSet &set) :
+            set{set}, pos{0}, index{0}, skip{1}, value{0}
+        {
+            next();
+        }
+
+        bool valid() const { return index <= set.count;}
+
+        /// Moves to the next value.
+        void next()
+        {
+            if (++index > set.count)
+                return;
+
+            uint64_t delta = 0;
+            unsigned shift = 0;
+            uint8_t byte;
+            do {
+                byte = set.data[pos++];
+                delta |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                shift += 7;
+            } while (byte & 0x80);
+            value += delta;
+        }
+
+        /// Moves to the first value which is not lower than target.
+        void seek(uint64_t target)
+        {
+            // blocks already passed by next()
+            while (skip < set.skips.size() && skip * block_size < index)
+                skip++;
+            while (skip < set.skips.size() && set.skips[skip].value <= target)
+            {
+                value = set.skips[skip].value;
+                pos = set.skips[skip].offset;
+                index = skip * block_size + 1;
+                skip++;
+            }
+            while (valid() && value < target)
+                next();
+        }
+    };
+
+public:
+    PrefixSet() : last{0}, count{0} {}
+
+    /// Appends a value greater than all values in the set.
+    /// @return number of added bytes
+    size_t push_back(uint64_t value);
+
+    /// Appends all values of another set increased by offset, they have to
+    /// be greater than all values in the set.
+    /// @return number of added bytes
+    size_t append(const PrefixSet &other, uint64_t offset);
+
+    size_t size() const { return count;}
+    uint64_t back() const { return last;}
+    bool empty() const { return count == 0;}
+
+    /// Number of bytes used by the set.
+    size_t memory() const
+    {
+        return data.capacity() + skips.capacity() * sizeof(Skip);
+    }
+
+    void shrink_to_fit()
+    {
+        data.shrink_to_fit();
+        skips.shrink_to_fit();
+    }
+
+    void clear()
+    {
+        vector<uint8_t>().swap(data);
+        vector<Skip>().swap(skips);
+        last = count = 0;
+    }
+
+    template<typename FuncType>
+    void for_each(FuncType func) const
+    {
+        for (Reader r(*this); r.valid(); r.next())
+            func(r.value);
+    }
+
+    static size_t intersection_count(const PrefixSet &a, const PrefixSet &b);
+};
+
+}
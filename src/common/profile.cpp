@@ -0,0 +1,226 @@
+/// @author Jakub Semric
+/// 2018
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+#include "profile.hpp"
+#include "nfa.hpp"
+
+namespace reduction
+{
+
+const unsigned SimProfile::buckets;
+
+void SimProfile::aggregate(const SimProfile &p)
+{
+    packets += p.packets;
+    bytes += p.bytes;
+    transitions += p.transitions;
+    active_sum += p.active_sum;
+    for (unsigned i = 0; i < buckets; i++) {
+        active_hist[i] += p.active_hist[i];
+        packet_hist[i] += p.packet_hist[i];
+    }
+    // the current packet of p is finished
+    if (p.packets)
+        packet_hist[min(bucket(p.packet_bytes), buckets - 1)]++;
+    for (size_t i = 0; i < visits.size(); i++)
+        visits[i] += p.visits[i];
+}
+
+Profiler &Profiler::instance()
+{
+    static Profiler profiler;
+    return profiler;
+}
+
+bool Profiler::available()
+{
+#ifdef NFA_PROFILE
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Profiler::name(const NfaArray &nfa, const string &name)
+{
+    lock_guard<mutex> guard(lock);
+    names.push_back(make_pair(&nfa, name));
+}
+
+unique_ptr<SimProfile> Profiler::attach(const NfaArray &nfa) const
+{
+    if (!enabled)
+        return nullptr;
+    return unique_ptr<SimProfile>(new SimProfile(nfa.state_count()));
+}
+
+void Profiler::detach(const NfaArray &nfa, const SimProfile &p)
+{
+    lock_guard<mutex> guard(lock);
+    auto &total = profiles[&nfa];
+    if (!total)
+        total.reset(new SimProfile(nfa.state_count()));
+    total->aggregate(p);
+}
+
+void Profiler::add_time(const string &stage, double seconds)
+{
+    lock_guard<mutex> guard(lock);
+    for (auto &i : stages) {
+        if (i.first == stage) {
+            i.second += seconds;
+            return;
+        }
+    }
+    stages.push_back(make_pair(stage, seconds));
+}
+
+/// @return indices of visited states sorted by the number of visits
+static vector<StateIdx> by_visits(const SimProfile &p)
+{
+    vector<StateIdx> res;
+    for (StateIdx i = 0; i < p.visits.size(); i++) {
+        if (p.visits[i])
+            res.push_back(i);
+    }
+    stable_sort(res.begin(), res.end(), [&p](StateIdx a, StateIdx b) {
+        return p.visits[a] > p.visits[b];});
+    return res;
+}
+
+/// @return the number of used buckets of a histogram
+static unsigned hist_size(const size_t *hist)
+{
+    unsigned n = SimProfile::buckets;
+    while (n && !hist[n - 1])
+        n--;
+    return n;
+}
+
+static size_t bucket_min(unsigned b) { return b ? 1ULL << (b - 1) : 0;}
+static size_t bucket_max(unsigned b) { return b ? (1ULL << b) - 1 : 0;}
+
+static void print_hist(ostream &out, const size_t *hist, size_t total)
+{
+    for (unsigned i = 0; i < hist_size(hist); i++) {
+        if (!hist[i])
+            continue;
+        ostringstream range;
+        range << bucket_min(i);
+        if (bucket_max(i) != bucket_min(i))
+            range << "-" << bucket_max(i);
+        out << "    " << setw(14) << left << range.str() << right
+            << setw(14) << hist[i] << setw(9) << fixed << setprecision(2)
+            << (total ? 100.0 * hist[i] / total : 0) << " %" << endl;
+    }
+    out.unsetf(ios::floatfield);
+}
+
+void Profiler::print(ostream &out) const
+{
+    lock_guard<mutex> guard(lock);
+    out << "profile" << endl;
+    for (auto &i : stages) {
+        out << "  " << setw(12) << left << i.first << right << " : "
+            << i.second << " s" << endl;
+    }
+
+    for (auto &n : names) {
+        auto it = profiles.find(n.first);
+        if (it == profiles.end())
+            continue;
+        const SimProfile &p = *it->second;
+        out << "  automaton  : " << n.second << endl;
+        out << "  packets    : " << p.packets << endl;
+        out << "  bytes      : " << p.bytes << endl;
+        out << "  transitions: " << p.transitions << endl;
+        if (p.bytes) {
+            out << "  active/byte: "
+                << static_cast<double>(p.active_sum) / p.bytes << endl;
+            out << "  trans/byte : "
+                << static_cast<double>(p.transitions) / p.bytes << endl;
+        }
+        out << "  active states per byte" << endl;
+        print_hist(out, p.active_hist, p.bytes);
+        out << "  bytes scanned per packet" << endl;
+        print_hist(out, p.packet_hist, p.packets);
+
+        auto states = by_visits(p);
+        out << "  most visited states (" << states.size() << " of "
+            << p.visits.size() << " visited)" << endl;
+        for (size_t i = 0; i < min<size_t>(states.size(), 10); i++) {
+            out << "    " << setw(14) << left
+                << n.first->get_state_label(states[i]) << right
+                << setw(14) << p.visits[states[i]] << endl;
+        }
+    }
+}
+
+static string json_str(const string &s)
+{
+    string res = "\"";
+    for (auto c : s) {
+        if (c == '"' || c == '\\')
+            res += '\\';
+        res += c;
+    }
+    return res + "\"";
+}
+
+static void write_hist(ostream &out, const size_t *hist)
+{
+    out << "[";
+    for (unsigned i = 0; i < hist_size(hist); i++) {
+        out << (i ? ", " : "") << "{\"min\": " << bucket_min(i)
+            << ", \"max\": " << bucket_max(i) << ", \"count\": " << hist[i]
+            << "}";
+    }
+    out << "]";
+}
+
+void Profiler::write_json(ostream &out) const
+{
+    lock_guard<mutex> guard(lock);
+    out << "{\n  \"stages\": {";
+    for (size_t i = 0; i < stages.size(); i++) {
+        out << (i ? ", " : "") << "\"" << stages[i].first << "\": "
+            << stages[i].second;
+    }
+    out << "},\n  \"automata\": [";
+
+    bool first = true;
+    for (auto &n : names) {
+        const NfaArray *nfa = n.first;
+        auto it = profiles.find(nfa);
+        if (it == profiles.end())
+            continue;
+        const SimProfile &p = *it->second;
+        out << (first ? "" : ",") << "\n    {\n"
+            << "      \"name\": " << json_str(n.second) << ",\n"
+            << "      \"states\": " << nfa->state_count() << ",\n"
+            << "      \"packets\": " << p.packets << ",\n"
+            << "      \"bytes\": " << p.bytes << ",\n"
+            << "      \"transitions\": " << p.transitions << ",\n"
+            << "      \"active_sum\": " << p.active_sum << ",\n"
+            << "      \"active_histogram\": ";
+        write_hist(out, p.active_hist);
+        out << ",\n      \"packet_bytes_histogram\": ";
+        write_hist(out, p.packet_hist);
+        out << ",\n      \"state_visits\": [";
+        auto states = by_visits(p);
+        for (size_t j = 0; j < states.size(); j++) {
+            out << (j ? ", " : "") << "{\"state\": \""
+                << nfa->get_state_label(states[j]) << "\", \"visits\": "
+                << p.visits[states[j]] << "}";
+        }
+        out << "]\n    }";
+        first = false;
+    }
+    out << "\n  ]\n}\n";
+}
+
+}
@@ -0,0 +1,165 @@
+/// @author Jakub Semric
+/// 2018
+
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace reduction
+{
+
+using namespace std;
+
+class NfaArray;
+
+/// Counters of the simulation of one automaton by one ScanContext. They are
+/// recorded only if the code is built with NFA_PROFILE defined
+/// (make PROFILE=1) and profiling is enabled, see Profiler.
+struct SimProfile
+{
+    /// histograms have buckets 0, 1, 2-3, 4-7, ...
+    static const unsigned buckets = 33;
+
+    size_t packets = 0;
+    size_t bytes = 0;
+    size_t transitions = 0;
+    /// sum of the sizes of the active set over all bytes
+    size_t active_sum = 0;
+    /// bytes read by the current packet before the simulation stopped
+    size_t packet_bytes = 0;
+    /// number of bytes read with the given size of the active set
+    size_t active_hist[buckets] = {};
+    /// number of packets which read the given number of bytes
+    size_t packet_hist[buckets] = {};
+    /// number of bytes after which the state is active, by state index
+    vector<size_t> visits;
+
+    SimProfile(size_t states) : visits(states) {}
+
+    static unsigned bucket(size_t x)
+    {
+        return x ? 64 - __builtin_clzll(x) : 0;
+    }
+
+    /// Starts the simulation of a new packet.
+    void packet()
+    {
+        if (packets)
+            packet_hist[min(bucket(packet_bytes), buckets - 1)]++;
+        packets++;
+        packet_bytes = 0;
+    }
+
+    /// One byte is read with the given number of active states.
+    void byte(size_t active)
+    {
+        bytes++;
+        packet_bytes++;
+        active_sum += active;
+        active_hist[min(bucket(active), buckets - 1)]++;
+    }
+
+    void transition(size_t n) { transitions += n;}
+    void visit(size_t state) { visits[state]++;}
+
+    void aggregate(const SimProfile &p);
+};
+
+/// Collects profiles of all contexts and times of processing stages, and
+/// reports them per automaton.
+class Profiler
+{
+private:
+    mutable mutex lock;
+    bool enabled;
+    vector<pair<const NfaArray*, string>> names;
+    map<const NfaArray*, unique_ptr<SimProfile>> profiles;
+    vector<pair<string, double>> stages;
+
+    Profiler() : enabled{false} {}
+
+public:
+    static Profiler &instance();
+
+    /// @return true if the code is built with NFA_PROFILE
+    static bool available();
+
+    void enable() { enabled = true;}
+    bool is_enabled() const { return enabled;}
+
+    /// Names the automaton in reports, only named automata are reported.
+    void name(const NfaArray &nfa, const string &name);
+
+    /// @return new profile of a context, or nullptr if profiling is not
+    /// enabled
+    unique_ptr<SimProfile> attach(const NfaArray &nfa) const;
+
+    /// Adds the profile of a context to the profile of its automaton.
+    void detach(const NfaArray &nfa, const SimProfile &p);
+
+    /// Adds time to a processing stage, stages of all threads are summed.
+    void add_time(const string &stage, double seconds);
+
+    /// Prints a human readable summary.
+    void print(ostream &out) const;
+    void write_json(ostream &out) const;
+};
+
+/// Adds the time of its scope to a processing stage.
+class StageTimer
+{
+private:
+    const char *stage;
+    chrono::steady_clock::time_point start;
+
+public:
+    StageTimer(const char *stage) :
+        stage{stage}, start{chrono::steady_clock::now()} {}
+
+    ~StageTimer()
+    {
+        Profiler::instance().add_time(
+            stage, chrono::duration<double>(
+                chrono::steady_clock::now() - start).count());
+    }
+};
+
+/// Measures consecutive processing stages of one thread.
+class StageClock
+{
+private:
+    chrono::steady_clock::time_point start;
+
+public:
+    StageClock() : start{chrono::steady_clock::now()} {}
+
+    /// Ends the current stage and starts the next one.
+    void lap(const char *stage)
+    {
+        auto now = chrono::steady_clock::now();
+        Profiler::instance().add_time(
+            stage, chrono::duration<double>(now - start).count());
+        start = now;
+    }
+};
+
+}
+
+#ifdef NFA_PROFILE
+/// Executes a statement with the profile of ScanContext, if it is profiled.
+#define NFA_PROFILE_HOOK(stmt) do { if (profile) { profile->stmt; } } while (0)
+/// Measures the rest of the scope as a processing stage.
+#define NFA_PROFILE_STAGE(var, stage) \
+    std::unique_ptr<reduction::StageTimer> var( \
+        reduction::Profiler::instance().is_enabled() ? \
+        new reduction::StageTimer(stage) : nullptr)
+#else
+#define NFA_PROFILE_HOOK(stmt) do {} while (0)
+#define NFA_PROFILE_STAGE(var, stage) do {} while (0)
+#endif
@@ -0,0 +1,176 @@
+/// @author Jakub Semric
+/// 2018
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include "reduction.hpp"
+
+namespace reduction
+{
+
+State UnionFind::find(State s)
+{
+    auto it = parent.find(s);
+    if (it == parent.end()) {
+        parent[s] = s;
+        size[s] = 1;
+        return s;
+    }
+
+    State root = it->second;
+    while (parent[root] != root)
+        root = parent[root];
+
+    // path compression
+    while (s != root) {
+        State next = parent[s];
+        parent[s] = root;
+        s = next;
+    }
+
+    return root;
+}
+
+void UnionFind::unite(State a, State b)
+{
+    a = find(a);
+    b = find(b);
+    if (a == b)
+        return;
+
+    if (size[a] < size[b])
+        swap(a, b);
+    parent[b] = a;
+    size[a] += size[b];
+}
+
+map<State, vector<State>> UnionFind::sets()
+{
+    map<State, vector<State>> res;
+    for (auto &i : parent)
+        res[find(i.first)].push_back(i.first);
+    return res;
+}
+
+/// Pruning NFA reduction (in place). The least frequent states are merged
+/// into a final state reachable from them, so that packets reaching them are
+/// accepted. States from which no final state is reachable are removed.
+/// @param nfa the NFA to reduce
+/// @param ratio reduction ratio, the number of kept states wrt the original
+/// number of states
+/// @param freq packet frequency of each state
+void pruning(Nfa &nfa, double ratio, const map<State, size_t> &freq)
+{
+    auto depth = nfa.state_depth();
+    vector<State> states;
+    for (auto s : nfa.get_states()) {
+        if (!nfa.is_final(s) && s != nfa.get_initial_state())
+            states.push_back(s);
+    }
+
+    // the most frequent and then the least deep states first
+    sort(states.begin(), states.end(),
+        [&](State a, State b) {
+            size_t fa = freq.at(a), fb = freq.at(b);
+            if (fa != fb)
+                return fa > fb;
+            if (depth[a] != depth[b])
+                return depth[a] < depth[b];
+            return a < b;
+        });
+
+    long cnt = nearbyint(ratio * nfa.state_count()) -
+        nfa.get_final_states().size() - 1;
+    if (cnt <= 1)
+        throw runtime_error("reduction ratio is too small");
+
+    map<State, State> fin;
+    for (auto &i : nfa.fin_pred()) {
+        for (auto s : i.second)
+            fin[s] = i.first;
+    }
+
+    map<State, State> mapping;
+    set<State> dead;
+    for (size_t i = cnt; i < states.size(); i++) {
+        auto it = fin.find(states[i]);
+        if (it != fin.end())
+            mapping[states[i]] = it->second;
+        else
+            dead.insert(states[i]);
+    }
+
+    nfa.merge_states(mapping);
+    nfa.remove_states(dead);
+}
+
+/// Merging NFA reduction (in place). Neighbouring states of low frequency
+/// are merged if their frequencies are similar, merging is transitive.
+/// @param nfa the NFA to reduce
+/// @param freq packet frequency of each state
+/// @param th merging threshold, min. ratio of frequencies of merged states
+/// @param max_fr maximal frequency of a state allowed to be merged
+/// @return the number of merged (removed) states
+size_t merging(
+    Nfa &nfa, const map<State, size_t> &freq, double th, double max_fr)
+{
+    if (th < 0 || th > 1)
+        throw runtime_error("invalid threshold value");
+    if (max_fr < 0 || max_fr > 1)
+        throw runtime_error("invalid max_fr value");
+
+    auto succ = nfa.succ();
+    State init = nfa.get_initial_state();
+    size_t max_freq = 0;
+    for (auto &i : freq)
+        max_freq = max(max_freq, i.second);
+    double max_ = max_fr * max_freq;
+
+    UnionFind groups;
+    set<State> visited{init};
+    vector<State> actual{init};
+    // BFS
+    while (!actual.empty()) {
+        vector<State> next;
+        for (auto p : actual) {
+            size_t freq_p = freq.at(p);
+            if (!nfa.is_final(p) && freq_p != 0 && freq_p / max_ <= max_fr &&
+                p != init)
+            {
+                for (auto q : succ[p]) {
+                    if (nfa.is_final(q) || q == p)
+                        continue;
+                    size_t freq_q = freq.at(q);
+                    double d = min(freq_q, freq_p) * 1.0 / max(freq_q, freq_p);
+                    if (d > th)
+                        groups.unite(p, q);
+                }
+            }
+
+            for (auto q : succ[p]) {
+                if (visited.insert(q).second)
+                    next.push_back(q);
+            }
+        }
+        actual.swap(next);
+    }
+
+    map<State, State> mapping;
+    for (auto &i : groups.sets()) {
+        auto &group = i.second;
+        // the initial state cannot be merged into another state
+        State rep = find(group.begin(), group.end(), init) != group.end() ?
+            init : group[0];
+        for (auto s : group) {
+            if (s != rep)
+                mapping[s] = rep;
+        }
+    }
+
+    nfa.merge_states(mapping);
+    return mapping.size();
+}
+
+}
@@ -0,0 +1,37 @@
+/// @author Jakub Semric
+/// 2018
+
+#pragma once
+
+#include <map>
+#include <vector>
+
+#include "nfa.hpp"
+
+namespace reduction
+{
+
+using namespace std;
+
+/// Disjoint sets of states with path compression and union by size.
+class UnionFind
+{
+private:
+    map<State, State> parent;
+    map<State, size_t> size;
+
+public:
+    State find(State s);
+    void unite(State a, State b);
+
+    /// @return representative -> states of its set
+    map<State, vector<State>> sets();
+};
+
+void pruning(Nfa &nfa, double ratio, const map<State, size_t> &freq);
+
+size_t merging(
+    Nfa &nfa, const map<State, size_t> &freq, double th = .995,
+    double max_fr = .1);
+
+}
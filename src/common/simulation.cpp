@@ -0,0 +1,373 @@
+/// @author Jakub Semric
+/// 2018
+
+#include <algorithm>
+#include <map>
+
+#include "simulation.hpp"
+
+namespace reduction
+{
+
+/// Moves of states over symbol classes stored in compressed rows.
+struct Moves
+{
+    unsigned classes;
+    vector<uint32_t> offsets;
+    vector<StateIdx> targets;
+
+    /// @param edges (source, class, target) of each move
+    Moves(size_t nstates, unsigned classes,
+        const vector<Triple<StateIdx, StateIdx, unsigned>> &edges) :
+        classes{classes}, offsets(nstates * classes + 1),
+        targets(edges.size())
+    {
+        for (auto &i : edges)
+            offsets[static_cast<size_t>(i.first) * classes + i.third + 1]++;
+        for (size_t i = 0; i < nstates * classes; i++)
+            offsets[i + 1] += offsets[i];
+
+        vector<uint32_t> pos(offsets.begin(), offsets.end() - 1);
+        for (auto &i : edges)
+            targets[pos[static_cast<size_t>(i.first) * classes + i.third]++] =
+                i.second;
+    }
+
+    const StateIdx *begin(StateIdx p, unsigned c) const {
+        return targets.data() + offsets[static_cast<size_t>(p) * classes + c];
+    }
+    const StateIdx *end(StateIdx p, unsigned c) const {
+        return targets.data() +
+            offsets[static_cast<size_t>(p) * classes + c + 1];
+    }
+};
+
+/// Computes the maximal simulation by refinement of an initial relation.
+/// Candidates simulating a state are first restricted to states which can
+/// move over all symbol classes the state can move over, and each move is
+/// checked once. Then a candidate q of p is removed if p moves over a symbol
+/// to t and q cannot move over it into a state simulating t. When states
+/// simulating t are removed, only candidates moving into them are checked
+/// again, which is the idea of the algorithm of Henzinger, Henzinger and
+/// Kopke without its counters.
+/// @param nfa the automaton
+/// @param backward compute backward simulation, i.e. over predecessors
+Simulation::Simulation(const NfaArray &nfa, bool backward) :
+    nstates{nfa.state_count()}, words{(nstates + 63) / 64},
+    rel(nstates * words)
+{
+    unsigned classes = nfa.get_class_count();
+    StateIdx init = nfa.get_initial_state_idx();
+
+    // moves in the direction of simulation and reversed moves
+    vector<Triple<StateIdx, StateIdx, unsigned>> edges, rev_edges;
+    for (StateIdx p = 0; p < nstates; p++) {
+        for (unsigned c = 0; c < classes; c++) {
+            for (auto t = nfa.succ_begin(p, c); t != nfa.succ_end(p, c); t++) {
+                edges.push_back(Triple<StateIdx, StateIdx, unsigned>(p, *t, c));
+                rev_edges.push_back(
+                    Triple<StateIdx, StateIdx, unsigned>(*t, p, c));
+            }
+        }
+    }
+    if (backward)
+        swap(edges, rev_edges);
+    Moves moves(nstates, classes, edges);
+    Moves rev(nstates, classes, rev_edges);
+
+    // symbol classes each state can move over, states with the same classes
+    // share the set of candidates
+    const size_t sig_words = (classes + 63) / 64;
+    vector<vector<uint64_t>> sig(nstates, vector<uint64_t>(sig_words));
+    for (StateIdx p = 0; p < nstates; p++) {
+        for (unsigned c = 0; c < classes; c++) {
+            if (moves.begin(p, c) != moves.end(p, c))
+                sig[p][c / 64] |= 1ULL << (c % 64);
+        }
+    }
+
+    map<vector<uint64_t>, vector<uint64_t>> candidates;
+    for (StateIdx p = 0; p < nstates; p++)
+        candidates[sig[p]];
+    for (auto &i : candidates) {
+        i.second.resize(words);
+        for (StateIdx q = 0; q < nstates; q++) {
+            bool covers = true;
+            for (size_t w = 0; w < sig_words; w++)
+                covers &= (i.first[w] & ~sig[q][w]) == 0;
+            if (covers)
+                i.second[q / 64] |= 1ULL << (q % 64);
+        }
+    }
+
+    for (StateIdx p = 0; p < nstates; p++) {
+        bool fixed = backward ? p == init : nfa.is_final_idx(p);
+        if (fixed) {
+            row(p)[p / 64] = 1ULL << (p % 64);
+        }
+        else {
+            auto &c = candidates[sig[p]];
+            copy(c.begin(), c.end(), row(p));
+        }
+    }
+
+    // removes candidates q of p which cannot follow the move of p over c to
+    // a state simulated by row rt
+    auto refine = [&](StateIdx p, unsigned c, const uint64_t *rt,
+        const uint64_t *check)
+    {
+        uint64_t *r = row(p);
+        bool changed = false;
+        for (size_t w = 0; w < words; w++) {
+            for (uint64_t bits = r[w] & check[w]; bits; bits &= bits - 1) {
+                StateIdx q = w * 64 + __builtin_ctzll(bits);
+                bool follows = false;
+                for (auto u = moves.begin(q, c);
+                    u != moves.end(q, c) && !follows; u++)
+                {
+                    follows = (rt[*u / 64] >> (*u % 64)) & 1;
+                }
+                if (!follows) {
+                    r[w] &= ~(1ULL << (q % 64));
+                    changed = true;
+                }
+            }
+        }
+        return changed;
+    };
+
+    // rows of states when the moves into them were checked the last time
+    vector<uint64_t> checked(rel);
+    vector<uint64_t> all(words, ~0ULL);
+    for (StateIdx p = 0; p < nstates; p++) {
+        for (unsigned c = 0; c < classes; c++) {
+            for (auto t = moves.begin(p, c); t != moves.end(p, c); t++)
+                refine(p, c, row(*t), all.data());
+        }
+    }
+
+    vector<StateIdx> work;
+    vector<bool> queued(nstates);
+    for (StateIdx p = nstates; p-- > 0; ) {
+        if (!equal(row(p), row(p) + words, checked.data() + p * words)) {
+            queued[p] = true;
+            work.push_back(p);
+        }
+    }
+
+    vector<uint64_t> removed(words), pre(words);
+    while (!work.empty()) {
+        StateIdx t = work.back();
+        work.pop_back();
+        queued[t] = false;
+
+        uint64_t *last = checked.data() + t * words;
+        for (size_t w = 0; w < words; w++) {
+            removed[w] = last[w] & ~row(t)[w];
+            last[w] = row(t)[w];
+        }
+
+        for (unsigned c = 0; c < classes; c++) {
+            if (rev.begin(t, c) == rev.end(t, c))
+                continue;
+
+            // states moving over c into a removed state
+            fill(pre.begin(), pre.end(), 0);
+            for (size_t w = 0; w < words; w++) {
+                for (uint64_t bits = removed[w]; bits; bits &= bits - 1) {
+                    StateIdx u = w * 64 + __builtin_ctzll(bits);
+                    for (auto q = rev.begin(u, c); q != rev.end(u, c); q++)
+                        pre[*q / 64] |= 1ULL << (*q % 64);
+                }
+            }
+
+            for (auto p = rev.begin(t, c); p != rev.end(t, c); p++) {
+                if (refine(*p, c, row(t), pre.data()) && !queued[*p]) {
+                    queued[*p] = true;
+                    work.push_back(*p);
+                }
+            }
+        }
+    }
+}
+
+/// @return states equivalent to p, including p
+vector<StateIdx> Simulation::equivalent_states(StateIdx p) const
+{
+    vector<StateIdx> res;
+    const uint64_t *r = rel.data() + p * words;
+    for (size_t w = 0; w < words; w++) {
+        for (uint64_t bits = r[w]; bits; bits &= bits - 1) {
+            StateIdx q = w * 64 + __builtin_ctzll(bits);
+            if (simulates(p, q))
+                res.push_back(q);
+        }
+    }
+    return res;
+}
+
+/// @return index of the state with given label in NfaArray
+static StateIdx state_index(const NfaArray &nfa, State state)
+{
+    StateIdx lo = 0, hi = nfa.state_count();
+    while (lo < hi) {
+        StateIdx mid = lo + (hi - lo) / 2;
+        if (nfa.get_state_label(mid) < state)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/// Removes transitions to states forward simulated by another successor
+/// over the same symbol, which does not change the language.
+/// @param nfa quotient of the automaton
+/// @param orig the automaton before quotienting
+/// @param sim forward simulation of orig
+/// @return the number of removed transitions
+static size_t prune_transitions(
+    Nfa &nfa, const NfaArray &orig, const Simulation &sim)
+{
+    NfaArray arr(nfa);
+    unsigned classes = arr.get_class_count();
+    vector<vector<Symbol>> symbols(classes);
+    for (unsigned c = 0; c < 256; c++)
+        symbols[arr.get_symbol_class(c)].push_back(c);
+
+    vector<StateIdx> index(arr.state_count());
+    for (StateIdx s = 0; s < arr.state_count(); s++)
+        index[s] = state_index(orig, arr.get_state_label(s));
+
+    vector<TransFormat> removed;
+    for (StateIdx p = 0; p < arr.state_count(); p++) {
+        for (unsigned c = 0; c < classes; c++) {
+            auto begin = arr.succ_begin(p, c), end = arr.succ_end(p, c);
+            for (auto t = begin; t != end; t++) {
+                bool little = false;
+                for (auto u = begin; u != end && !little; u++)
+                    little = *u != *t && sim.simulates(index[*u], index[*t]);
+                if (!little)
+                    continue;
+                for (auto a : symbols[c]) {
+                    removed.push_back(TransFormat{
+                        arr.get_state_label(p), arr.get_state_label(*t), a});
+                }
+            }
+        }
+    }
+
+    nfa.remove_transitions(removed);
+    return removed.size();
+}
+
+/// Removes states which are not reachable from the initial state or from
+/// which no final state is reachable (in place).
+/// @return the number of removed states
+size_t remove_useless(Nfa &nfa)
+{
+    auto succ = nfa.succ();
+    map<State, set<State>> pred;
+    for (auto &i : succ) {
+        for (auto q : i.second)
+            pred[q].insert(i.first);
+    }
+
+    auto closure = [](map<State, set<State>> &next, vector<State> actual) {
+        set<State> visited(actual.begin(), actual.end());
+        while (!actual.empty()) {
+            State q = actual.back();
+            actual.pop_back();
+            for (auto r : next[q]) {
+                if (visited.insert(r).second)
+                    actual.push_back(r);
+            }
+        }
+        return visited;
+    };
+
+    State init = nfa.get_initial_state();
+    auto finals = nfa.get_final_states();
+    auto reachable = closure(succ, vector<State>{init});
+    auto useful = closure(pred, vector<State>(finals.begin(), finals.end()));
+
+    set<State> useless;
+    for (auto s : nfa.get_states()) {
+        if (s != init && (!reachable.count(s) || !useful.count(s)))
+            useless.insert(s);
+    }
+
+    nfa.remove_states(useless);
+    return useless.size();
+}
+
+/// Merges states equivalent wrt forward or backward simulation (in place),
+/// which does not change the language. A state is merged into the initial
+/// state or into a final state of its class, if there is one, final states
+/// are not merged with each other, so that each of them keeps its rule.
+/// Forward quotient also removes transitions to states simulated by another
+/// successor over the same symbol.
+/// @param nfa the NFA to reduce
+/// @param backward use backward instead of forward simulation
+/// @param pruned the number of removed transitions is stored here
+/// @return the number of merged (removed) states
+size_t simulation_quotient(Nfa &nfa, bool backward, size_t *pruned)
+{
+    NfaArray arr(nfa);
+    Simulation sim(arr, backward);
+    StateIdx init = arr.get_initial_state_idx();
+
+    vector<bool> merged(arr.state_count());
+    map<State, State> mapping;
+    for (StateIdx p = 0; p < arr.state_count(); p++) {
+        if (merged[p])
+            continue;
+
+        auto group = sim.equivalent_states(p);
+        StateIdx rep = group[0];
+        for (auto q : group) {
+            if (arr.is_final_idx(q) && !arr.is_final_idx(rep))
+                rep = q;
+        }
+        if (find(group.begin(), group.end(), init) != group.end())
+            rep = init;
+
+        for (auto q : group) {
+            merged[q] = true;
+            if (q != rep && !arr.is_final_idx(q))
+                mapping[arr.get_state_label(q)] = arr.get_state_label(rep);
+        }
+    }
+
+    nfa.merge_states(mapping);
+    size_t n = backward ? 0 : prune_transitions(nfa, arr, sim);
+    if (pruned)
+        *pruned = n;
+    return mapping.size();
+}
+
+/// Language preserving NFA reduction (in place). Useless states are removed
+/// and states equivalent wrt forward and backward simulation are merged, until
+/// the automaton does not change.
+/// @param nfa the NFA to reduce
+/// @param forward merge states by forward simulation
+/// @param backward merge states by backward simulation
+/// @return the number of removed states
+size_t minimize(Nfa &nfa, bool forward, bool backward)
+{
+    size_t orig = nfa.state_count();
+    size_t changes, pruned;
+    do {
+        changes = remove_useless(nfa);
+        if (forward) {
+            changes += simulation_quotient(nfa, false, &pruned);
+            changes += pruned + remove_useless(nfa);
+        }
+        if (backward)
+            changes += simulation_quotient(nfa, true);
+    } while (changes);
+
+    return orig - nfa.state_count();
+}
+
+}
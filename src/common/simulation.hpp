@@ -0,0 +1,57 @@
+/// @author Jakub Semric
+/// 2018
+
+#pragma once
+
+#include <vector>
+
+#include "nfa.hpp"
+
+namespace reduction
+{
+
+using namespace std;
+
+/// Maximal forward or backward simulation preorder over states of NfaArray,
+/// stored as a bit matrix over state indexes.
+///
+/// State q forward simulates p if every symbol read from p can be read from
+/// q into a state simulating the successor of p. Final states stand for
+/// distinct rules, so a final state is simulated only by itself. Backward
+/// simulation is defined in the same way over predecessors and only the
+/// initial state simulates the initial state.
+class Simulation
+{
+private:
+    size_t nstates;
+    size_t words;
+    /// row p is the set of states simulating p
+    vector<uint64_t> rel;
+
+    uint64_t *row(StateIdx p) { return rel.data() + p * words;}
+
+public:
+    Simulation(const NfaArray &nfa, bool backward = false);
+
+    /// @return true if state q simulates state p
+    bool simulates(StateIdx q, StateIdx p) const {
+        return (rel[p * words + q / 64] >> (q % 64)) & 1;
+    }
+
+    bool equivalent(StateIdx p, StateIdx q) const {
+        return simulates(p, q) && simulates(q, p);
+    }
+
+    vector<StateIdx> equivalent_states(StateIdx p) const;
+
+    size_t state_count() const { return nstates;}
+};
+
+size_t remove_useless(Nfa &nfa);
+
+size_t simulation_quotient(
+    Nfa &nfa, bool backward, size_t *pruned = nullptr);
+
+size_t minimize(Nfa &nfa, bool forward = true, bool backward = true);
+
+}
@@ -0,0 +1,123 @@
+/// @author Jakub Semric
+/// 2018
+
+#pragma once
+
+#include <atomic>
+#include <future>
+#include <string>
+#include <vector>
+
+#include "nfa.hpp"
+#include "pcap_reader.hpp"
+#include "work_queue.hpp"
+
+namespace reduction
+{
+
+using namespace std;
+
+/// Computes frequencies in parallel. PCAP files are split into chunks of
+/// packets distributed among workers with work stealing, each worker counts
+/// into its own array aligned to cache lines and the arrays are summed at the
+/// end.
+/// @param matchers one matcher per worker
+/// @param state_freq frequencies, which are increased
+/// @param pcaps PCAP files
+/// @param func function called by workers with the matcher, counters of the
+/// worker and PayloadBatch
+/// @param chunk_size max. number of packets in one chunk
+/// @param batch_size max. number of payloads in one batch
+template<typename Matcher, typename F>
+void compute_freq_parallel(
+    const vector<Matcher*> &matchers, StateFreq &state_freq,
+    const vector<string> &pcaps, F func, unsigned long chunk_size = 4096,
+    size_t batch_size = 64)
+{
+    struct FreqTask
+    {
+        size_t pcap;
+        pcapreader::PcapChunk chunk;
+    };
+
+    vector<FreqTask> tasks;
+    for (size_t i = 0; i < pcaps.size(); i++) {
+        for (auto &c : pcapreader::index_pcap(pcaps[i].c_str(), chunk_size))
+            tasks.push_back(FreqTask{i, c});
+    }
+
+    WorkStealingQueue<FreqTask> queue(tasks, matchers.size());
+    vector<StateFreq> freq(matchers.size());
+    vector<future<void>> workers;
+    atomic<bool> stop{false};
+
+    for (unsigned i = 0; i < matchers.size(); i++) {
+        workers.push_back(async(launch::async, [&, i] () {
+            // allocated by the worker, so that it is local to it
+            freq[i] = StateFreq(state_freq.size());
+            // each file is opened once by the worker
+            vector<unique_ptr<pcapreader::ChunkReader>> readers(pcaps.size());
+            FreqTask task;
+            try {
+                while (!stop && queue.pop(i, task)) {
+                    auto &reader = readers[task.pcap];
+                    if (!reader) {
+                        reader.reset(new pcapreader::ChunkReader(
+                            pcaps[task.pcap].c_str()));
+                    }
+                    pcapreader::process_payload_chunk_batch(
+                        *reader, task.chunk,
+                        [&] (const pcapreader::PayloadBatch &batch)
+                        {
+                            func(*matchers[i], freq[i], batch);
+                        }, batch_size);
+                }
+            }
+            catch (...) {
+                stop = true;
+                throw;
+            }
+        }));
+    }
+
+    for (auto &i : workers)
+        i.get();
+
+    for (auto &i : freq) {
+        for (size_t j = 0; j < state_freq.size(); j++)
+            state_freq[j] += i[j];
+    }
+}
+
+/// Computes packet frequency of each state over all packets of PCAP files.
+/// @param nfa simulated automaton
+/// @param pcaps PCAP files
+/// @param nworkers number of threads
+/// @return frequency of each state index
+inline StateFreq compute_state_freq(
+    const NfaArray &nfa, const vector<string> &pcaps, unsigned nworkers)
+{
+    vector<unique_ptr<ScanContext>> contexts;
+    vector<ScanContext*> matchers;
+    for (unsigned i = 0; i < nworkers; i++) {
+        contexts.emplace_back(new ScanContext(nfa));
+        matchers.push_back(contexts.back().get());
+    }
+
+    StateFreq state_freq(nfa.state_count());
+    compute_freq_parallel(
+        matchers, state_freq, pcaps,
+        [] (ScanContext &ctx, StateFreq &freq,
+            const pcapreader::PayloadBatch &batch)
+        {
+            for (size_t i = 0; i < batch.size(); i++) {
+                ctx.label_states(
+                    freq, batch.payloads[i], batch.lengths[i],
+                    batch.count(i));
+            }
+        });
+
+    return state_freq;
+}
+
+}
@@ -0,0 +1,235 @@
+/// @author Jakub Semric
+/// 2018
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "target_cache.hpp"
+
+namespace reduction
+{
+
+const uint32_t TargetCache::version;
+
+/// Header of the sidecar file, followed by the packet count and the number
+/// of matching packets of each chunk, and then by index, offsets and finals
+/// of each chunk.
+struct TargetCacheHeader
+{
+    char magic[8];          // "AHOFATGT"
+    uint32_t version;
+    uint32_t chunk_size;
+    uint64_t target_hash;
+    uint64_t pcap_size;
+    uint64_t pcap_hash;
+    uint64_t chunk_count;
+};
+
+static uint64_t fnv1a(const void *data, size_t size, uint64_t h)
+{
+    const uint8_t *p = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+/// FNV-1a over 64-bit words, the tail shorter than a word is hashed by bytes.
+static uint64_t fnv1a_words(const char *data, size_t size, uint64_t h)
+{
+    size_t words = size / sizeof(uint64_t);
+    for (size_t i = 0; i < words; i++) {
+        uint64_t w;
+        memcpy(&w, data + i * sizeof(uint64_t), sizeof(w));
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    size_t done = words * sizeof(uint64_t);
+    return fnv1a(data + done, size - done, h);
+}
+
+/// Hashes the size and the whole content of a file. Reading the file is
+/// much cheaper than the simulation of the target, and unlike size, mtime or
+/// sampled content it detects captures edited in place or rewritten with
+/// the same size. A collision of the 64-bit hash is the only remaining risk.
+static void fingerprint(const string &fname, uint64_t &size, uint64_t &hash)
+{
+    const size_t block = 1 << 20;
+    FILE *f = fopen(fname.c_str(), "rb");
+    if (!f)
+        throw runtime_error("cannot open pcap file '" + fname + "'");
+
+    vector<char> buf(block);
+    size = 0;
+    hash = 14695981039346656037ULL;
+    size_t n;
+    // blocks are multiples of the word, so only the last one has a tail
+    while ((n = fread(buf.data(), 1, block, f)) > 0) {
+        hash = fnv1a_words(buf.data(), n, hash);
+        size += n;
+    }
+    bool failed = ferror(f);
+    fclose(f);
+    if (failed)
+        throw runtime_error("cannot read pcap file '" + fname + "'");
+
+    hash = fnv1a(&size, sizeof(size), hash);
+}
+
+TargetCache::TargetCache(
+    const NfaArray &target, const string &pcap, uint32_t chunk_size,
+    size_t chunk_count) :
+    target_hash{target.image_hash()}, target_states{target.state_count()},
+    chunk_size{chunk_size},
+    chunks(chunk_count)
+{
+    fingerprint(pcap, pcap_size, pcap_hash);
+}
+
+string TargetCache::filename(const string &dir, const string &pcap) const
+{
+    auto slash = pcap.rfind('/');
+    string base = slash == string::npos ? pcap : pcap.substr(slash + 1);
+    ostringstream ss;
+    // the content hash tells apart captures of the same name in different
+    // directories, the name is kept only for readability
+    ss << dir << "/" << base << "." << hex << pcap_hash << "." << target_hash
+        << ".tcache";
+    return ss.str();
+}
+
+/// Loads results and checks that every section is consistent, so that
+/// a damaged file is treated as a missing one.
+bool TargetCache::load(const string &fname)
+{
+    if (!read_chunks(fname)) {
+        // chunks are recorded from scratch
+        for (auto &c : chunks)
+            c = ChunkMatches();
+        return false;
+    }
+    return true;
+}
+
+bool TargetCache::read_chunks(const string &fname)
+{
+    ifstream in{fname, ios::binary | ios::ate};
+    if (!in.is_open())
+        return false;
+    uint64_t remaining = in.tellg();
+    in.seekg(0);
+
+    // sizes are checked against the rest of the file before allocation
+    auto read = [&in, &remaining](void *data, uint64_t size) {
+        if (size > remaining || !in.read(static_cast<char*>(data), size))
+            return false;
+        remaining -= size;
+        return true;
+    };
+
+    TargetCacheHeader h;
+    if (!read(&h, sizeof(h)) ||
+        memcmp(h.magic, "AHOFATGT", 8) || h.version != version ||
+        h.chunk_size != chunk_size || h.target_hash != target_hash ||
+        h.pcap_size != pcap_size || h.pcap_hash != pcap_hash ||
+        h.chunk_count != chunks.size())
+    {
+        return false;
+    }
+
+    vector<uint32_t> counts(2 * chunks.size());
+    if (!read(counts.data(), counts.size() * sizeof(uint32_t)))
+        return false;
+    for (size_t i = 0; i < chunks.size(); i++) {
+        auto &c = chunks[i];
+        c.packets = counts[2 * i];
+        uint64_t matches = counts[2 * i + 1];
+        if (matches > c.packets || matches * 2 * sizeof(uint32_t) > remaining)
+            return false;
+
+        c.index.resize(matches);
+        c.offsets.resize(matches + 1);
+        if (!read(c.index.data(), c.index.size() * sizeof(uint32_t)) ||
+            !read(c.offsets.data(), c.offsets.size() * sizeof(uint32_t)))
+        {
+            return false;
+        }
+
+        // packets are ascending and each has a range of final states
+        if (c.offsets[0] != 0)
+            return false;
+        for (size_t j = 0; j < matches; j++) {
+            if (c.index[j] >= c.packets ||
+                (j && c.index[j] <= c.index[j - 1]) ||
+                c.offsets[j + 1] < c.offsets[j])
+            {
+                return false;
+            }
+        }
+
+        if (c.offsets.back() * sizeof(StateIdx) > remaining)
+            return false;
+        c.finals.resize(c.offsets.back());
+        if (!read(c.finals.data(), c.finals.size() * sizeof(StateIdx)))
+            return false;
+        for (auto s : c.finals) {
+            if (s >= target_states)
+                return false;
+        }
+    }
+
+    return remaining == 0;
+}
+
+void TargetCache::save(const string &fname) const
+{
+    // written to a unique temporary file in the same directory and renamed,
+    // so that concurrent writers of the same file never mix their content
+    // and readers see either the old or the new file
+    string tmp = fname + ".XXXXXX";
+    int fd = mkstemp(&tmp[0]);
+    FILE *out = fd < 0 ? nullptr : fdopen(fd, "wb");
+    if (!out) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp.c_str());
+        }
+        throw runtime_error("cannot write target cache file '" + fname + "'");
+    }
+
+    TargetCacheHeader h;
+    memcpy(h.magic, "AHOFATGT", 8);
+    h.version = version;
+    h.chunk_size = chunk_size;
+    h.target_hash = target_hash;
+    h.pcap_size = pcap_size;
+    h.pcap_hash = pcap_hash;
+    h.chunk_count = chunks.size();
+    fwrite(&h, sizeof(h), 1, out);
+
+    vector<uint32_t> counts;
+    for (auto &c : chunks) {
+        counts.push_back(c.packets);
+        counts.push_back(c.index.size());
+    }
+    fwrite(counts.data(), sizeof(uint32_t), counts.size(), out);
+
+    for (auto &c : chunks) {
+        fwrite(c.index.data(), sizeof(uint32_t), c.index.size(), out);
+        fwrite(c.offsets.data(), sizeof(uint32_t), c.offsets.size(), out);
+        fwrite(c.finals.data(), sizeof(StateIdx), c.finals.size(), out);
+    }
+
+    // mkstemp creates the file readable only by the owner
+    bool failed = ferror(out) || fchmod(fd, 0644);
+    if (fclose(out) || failed || rename(tmp.c_str(), fname.c_str())) {
+        unlink(tmp.c_str());
+        throw runtime_error("cannot write target cache file '" + fname + "'");
+    }
+}
+
+}
@@ -0,0 +1,72 @@
+/// @author Jakub Semric
+/// 2018
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "nfa.hpp"
+
+namespace reduction
+{
+
+using namespace std;
+
+/// Final states of the target automaton reached by packets of one chunk of
+/// PCAP file. Only packets reaching some final state are stored.
+struct ChunkMatches
+{
+    /// number of packets with payload in the chunk
+    uint32_t packets;
+    /// ordinal numbers of packets reaching final states, ascending
+    vector<uint32_t> index;
+    /// final states of packet index[i] are finals[offsets[i]..offsets[i+1]]
+    vector<uint32_t> offsets;
+    vector<StateIdx> finals;
+
+    ChunkMatches() : packets{0}, offsets{0} {}
+};
+
+/// Results of the target automaton over one PCAP file, which are stored in
+/// a sidecar file and reused by evaluation of other reduced automata. The
+/// file is keyed by the hash of the compiled target and by the size and
+/// the hash of the whole content of PCAP file.
+class TargetCache
+{
+private:
+    uint64_t target_hash;
+    uint64_t target_states;
+    uint64_t pcap_size;
+    uint64_t pcap_hash;
+    uint32_t chunk_size;
+    vector<ChunkMatches> chunks;
+
+    static const uint32_t version = 2;
+
+    bool read_chunks(const string &fname);
+
+public:
+    /// @param target target automaton
+    /// @param pcap PCAP file
+    /// @param chunk_size max. number of packets in one chunk
+    /// @param chunk_count number of chunks of PCAP file
+    TargetCache(
+        const NfaArray &target, const string &pcap, uint32_t chunk_size,
+        size_t chunk_count);
+
+    /// Name of the sidecar file of PCAP file in the cache directory, it
+    /// contains the hashes of PCAP file and of the target.
+    string filename(const string &dir, const string &pcap) const;
+
+    /// Loads results stored by save().
+    /// @return false if the file does not exist, it belongs to other
+    /// target or PCAP file or it is damaged, the chunks are empty then
+    bool load(const string &fname);
+    void save(const string &fname) const;
+
+    ChunkMatches &chunk(size_t i) { return chunks[i];}
+};
+
+}
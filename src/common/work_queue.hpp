@@ -0,0 +1,76 @@
+/// @author Jakub Semric
+/// 2018
+
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace reduction
+{
+
+using namespace std;
+
+/// Distributes tasks known in advance among workers. Each worker has its own
+/// deque and takes tasks from its front, so it processes a contiguous range
+/// of tasks. When the deque is empty, the worker steals from the back of the
+/// deques of other workers.
+template<typename Task>
+class WorkStealingQueue
+{
+private:
+    struct WorkerDeque
+    {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    vector<unique_ptr<WorkerDeque>> deques;
+
+public:
+    /// @param tasks all tasks, divided into contiguous blocks per worker
+    /// @param nworkers number of workers
+    WorkStealingQueue(const vector<Task> &tasks, unsigned nworkers)
+    {
+        for (unsigned i = 0; i < nworkers; i++) {
+            deques.emplace_back(new WorkerDeque);
+            size_t first = tasks.size() * i / nworkers;
+            size_t last = tasks.size() * (i + 1) / nworkers;
+            deques.back()->tasks.assign(
+                tasks.begin() + first, tasks.begin() + last);
+        }
+    }
+
+    /// Gets next task of the worker.
+    /// @param worker worker number
+    /// @param task obtained task
+    /// @return false if there are no tasks left
+    bool pop(unsigned worker, Task &task)
+    {
+        {
+            auto &own = *deques[worker];
+            lock_guard<mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task = own.tasks.front();
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < deques.size(); i++) {
+            auto &victim = *deques[(worker + i) % deques.size()];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+
+        return false;
+    }
+};
+
+}
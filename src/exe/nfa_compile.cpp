@@ -0,0 +1,69 @@
+/// @author Jakub Semric
+/// 2018
+
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <getopt.h>
+
+#include "nfa.hpp"
+
+using namespace reduction;
+using namespace std;
+
+const char *helpstr =
+"Usage: ./nfa_compile [OPTIONS] NFA OUTPUT\n"
+"Compile NFA in the .fa format to a binary image, which is mapped to memory\n"
+"by nfa_eval, state_frequency and prefix_labeling instead of parsing.\n"
+"\noptions:\n"
+"  -h            : show this help and exit\n"
+"  -d            : decompile, i.e. convert a binary image to the .fa format\n";
+
+int main(int argc, char **argv)
+{
+    bool decompile = false;
+    int opt_cnt = 1;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "hd")) != -1) {
+            opt_cnt++;
+            switch (c) {
+                // general options
+                case 'h':
+                    cerr << helpstr;
+                    return 0;
+                case 'd':
+                    decompile = true;
+                    break;
+                default:
+                    return 1;
+            }
+        }
+
+        if (argc - opt_cnt < 2) {
+            throw runtime_error("2 arguments required: NFA OUTPUT");
+        }
+
+        NfaArray nfa = NfaArray::load(argv[opt_cnt]);
+        if (decompile) {
+            ofstream out{argv[opt_cnt + 1]};
+            if (!out.is_open())
+                throw runtime_error("cannot open output file");
+            nfa.print(out);
+        }
+        else {
+            nfa.write(argv[opt_cnt + 1]);
+        }
+
+        cerr << "states    : " << nfa.state_count() << endl;
+        cerr << "trans     : " << nfa.trans_count() << endl;
+        cerr << "classes   : " << nfa.get_class_count() << endl;
+    }
+    catch (exception &e) {
+        cerr << "\033[1;31mERROR\033[0m " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
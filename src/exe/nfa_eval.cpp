@@ -3,13 +3,14 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <algorithm>
 #include <vector>
 #include <map>
 #include <stdexcept>
 #include <ctime>
 #include <chrono>
 #include <thread>
-#include <future>
 #include <ctype.h>
 #include <getopt.h>
 
@@ -26,19 +27,41 @@ namespace fs = boost::filesystem;
 const char *helpstr =
 "Usage: ./nfa_eval [OPTIONS] TARGET REDUCED PCAP...\n"
 "Compute error of the REDUCED automaton wrt TARGET and PCAP files.\n"
-"TARGET and REDUCED are NFAs in the .fa format\n"
-"PCAP is a packet capture file\n"
+"TARGET and REDUCED are NFAs in the .fa format or compiled by nfa_compile\n"
+"REDUCED may be also a comma separated list of automata or a directory,\n"
+"all of them are evaluated in one pass over PCAP files, only .fa files and\n"
+"compiled automata of the directory are taken\n"
+"PCAP is a packet capture file or a corpus created by pcap_corpus, whose\n"
+"distinct payloads are matched once and reported per original PCAP file\n"
 "\noptions:\n"
 "  -h            : show this help and exit\n"
 "  -o <FILE>     : specify the output file\n"
 "  -n <NWORKERS> : number of workers to run in parallel\n"
 "  -r            : rigorous error computation, consistent but much slower,\n"
 "                  use only if not sure about over-approximation\n"
-"  -c            : output in the csv format\n";
+"  -c            : output in the csv format\n"
+"  -l <MB>       : simulate automata by lazy DFA with cache of at most MB\n"
+"                  megabytes per automaton and worker\n"
+"  -p            : pipeline mode, PCAP files are read by one thread and\n"
+"                  matched by NWORKERS threads\n"
+"  -C <DIR>      : cache results of TARGET over each PCAP in DIR, later runs\n"
+"                  with the same TARGET and PCAP simulate only REDUCED\n"
+"  --profile <FILE> : print a profile of the simulation of automata and time\n"
+"                  of processing stages, and write it to FILE in JSON,\n"
+"                  requires a build with make PROFILE=1\n";
+
+/// Value returned by getopt_long for --profile.
+const int profile_opt = 256;
+
+const option long_options[] = {
+    {"profile", required_argument, nullptr, profile_opt},
+    {nullptr, 0, nullptr, 0}
+};
 
 void write_nfa_stats(
     ostream &out, const vector<pair<string,NfaStats>> &data,
-    string reduced_str, bool csv, size_t sc_t, size_t sc_r)
+    string reduced_str, bool csv, size_t sc_t, size_t sc_r,
+    bool name = false)
 {
     float ratio = sc_r * 1.0 / sc_t;
     if (csv) {
@@ -61,6 +84,8 @@ void write_nfa_stats(
 
         assert(precision >= 0 && precision <= 1);
         assert(0 <= accuracy && accuracy <= 1);
+        if (name)
+            out << "reduced   : " << fs::basename(reduced_str) << endl;
         out << "reduction : " << ratio << endl;
         out << "total     : " << aggr.total << endl;
         out << "accuracy  : " << accuracy << endl;
@@ -68,17 +93,48 @@ void write_nfa_stats(
     }
 }
 
+/// Expands REDUCED argument to filenames of automata, it is either a comma
+/// separated list of files or a directory, whose .fa files and compiled
+/// images are taken in alphabetical order, other files are skipped.
+vector<string> reduced_files(const string &arg)
+{
+    vector<string> res;
+    if (fs::is_directory(arg)) {
+        for (auto &i : fs::directory_iterator(arg)) {
+            if (!fs::is_regular_file(i.path()))
+                continue;
+            string f = i.path().string();
+            if (i.path().extension() == ".fa" || NfaArray::is_image(f))
+                res.push_back(f);
+            else
+                cerr << "\033[1;33mWARNING\033[0m skipping '" << f
+                    << "', not an automaton" << endl;
+        }
+        sort(res.begin(), res.end());
+    }
+    else {
+        istringstream ss{arg};
+        string f;
+        while (getline(ss, f, ','))
+            res.push_back(f);
+    }
+
+    if (res.empty())
+        throw runtime_error("no reduced automaton given");
+    return res;
+}
+
 int main(int argc, char **argv)
 {
     chrono::steady_clock::time_point timepoint = chrono::steady_clock::now();
-    string outfile;
+    string outfile, cache_dir, profile_file;
     vector<string> pcaps;
     unsigned nworkers = 1;
-    bool consistent = false, csv = false;
+    size_t lazy_dfa_mem = 0;
+    bool consistent = false, csv = false, pipeline = false;
 
-    string nfa_str1, nfa_str2;
+    string nfa_str1;
 
-    int opt_cnt = 1;    // program name
     int c;
 
     try {
@@ -87,8 +143,9 @@ int main(int argc, char **argv)
             return 1;
         }
 
-        while ((c = getopt(argc, argv, "ho:n:rc")) != -1) {
-            opt_cnt++;
+        while ((c = getopt_long(
+            argc, argv, "ho:n:rcl:pC:", long_options, nullptr)) != -1)
+        {
             switch (c) {
                 // general options
                 case 'h':
@@ -96,11 +153,9 @@ int main(int argc, char **argv)
                     return 0;
                 case 'o':
                     outfile = optarg;
-                    opt_cnt++;
                     break;
                 case 'n':
                     nworkers = stoi(optarg);
-                    opt_cnt++;
                     break;
                 case 'r':
                     consistent = true;
@@ -108,27 +163,55 @@ int main(int argc, char **argv)
                 case 'c':
                     csv = true;
                     break;
+                case 'l':
+                    lazy_dfa_mem = stoul(optarg);
+                    break;
+                case 'p':
+                    pipeline = true;
+                    break;
+                case 'C':
+                    cache_dir = optarg;
+                    break;
+                case profile_opt:
+                    profile_file = optarg;
+                    break;
                 default:
                     return 1;
             }
         }
 
-        if (argc - opt_cnt < 3)
+        if (argc - optind < 3)
         {
             throw runtime_error("invalid positional arguments");
         }
+        if (profile_file != "") {
+            if (!Profiler::available())
+                throw runtime_error("--profile requires a build with PROFILE=1");
+            Profiler::instance().enable();
+        }
+        StageClock clock;
 
         nworkers = min(nworkers, thread::hardware_concurrency());
         assert(nworkers > 0);
 
         // get automata
-        nfa_str1 = argv[opt_cnt];
-        NfaArray target(Nfa::read_from_file(nfa_str1));
-        nfa_str2 = argv[opt_cnt + 1];
-        NfaArray reduced(Nfa::read_from_file(nfa_str2));
+        nfa_str1 = argv[optind];
+        NfaArray target = NfaArray::load(nfa_str1);
+        vector<string> reduced_str = reduced_files(argv[optind + 1]);
+        vector<NfaArray> reduced;
+        reduced.reserve(reduced_str.size());
+        for (auto &i : reduced_str)
+            reduced.push_back(NfaArray::load(i));
+        vector<const NfaArray*> reduced_ptr;
+        for (auto &i : reduced)
+            reduced_ptr.push_back(&i);
         // get capture files
-        for (int i = opt_cnt + 2; i < argc; i++)
+        for (int i = optind + 2; i < argc; i++)
             pcaps.push_back(argv[i]);
+        Profiler::instance().name(target, fs::basename(nfa_str1));
+        for (size_t i = 0; i < reduced.size(); i++)
+            Profiler::instance().name(reduced[i], fs::basename(reduced_str[i]));
+        clock.lap("load");
 
         ostream *output = &cout;
         if (outfile != "") {
@@ -137,27 +220,33 @@ int main(int argc, char **argv)
                 throw runtime_error("cannot open output file");
         }
 
-        // divide work
-        vector<vector<string>> v(nworkers);
-        for (unsigned i = 0; i < pcaps.size(); i++)
-            v[i % nworkers].push_back(pcaps[i]);
-
-        vector<pair<string,NfaStats>> stats;
-        vector<future<vector<pair<string,NfaStats>>>> threads;
-        for (unsigned i = 0; i < nworkers; i++)
-            threads.push_back(
-                async(
-                    compute_nfa_stats, ref(target),ref(reduced),ref(v[i]),
-                    consistent)
-                );
-
-        for (unsigned i = 0; i < nworkers; i++) {
-            auto r = threads[i].get();
-            stats.insert(stats.end(), r.begin(), r.end());
+        LazyDfaCounters counters;
+        pcapreader::PipelineCounters pipeline_counters;
+        auto stats = compute_nfa_stats(
+            target, reduced_ptr, pcaps, nworkers, consistent, lazy_dfa_mem,
+            &counters, pipeline ? &pipeline_counters : nullptr, cache_dir);
+        clock.lap("evaluation");
+
+        for (size_t i = 0; i < reduced.size(); i++) {
+            write_nfa_stats(
+                *output, stats[i], reduced_str[i], csv, target.state_count(),
+                reduced[i].state_count(), reduced.size() > 1);
         }
 
-        write_nfa_stats(*output, stats, nfa_str2, csv, target.state_count(),
-            reduced.state_count());
+        if (lazy_dfa_mem) {
+            counters.print(cerr);
+        }
+        if (pipeline) {
+            pipeline_counters.print(cerr);
+        }
+        clock.lap("output");
+        if (profile_file != "") {
+            ofstream out{profile_file};
+            if (!out.is_open())
+                throw runtime_error("cannot open profile file");
+            Profiler::instance().write_json(out);
+            Profiler::instance().print(cerr);
+        }
 
         unsigned msec = chrono::duration_cast<chrono::microseconds>(
             chrono::steady_clock::now() - timepoint).count();
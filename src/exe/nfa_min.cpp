@@ -0,0 +1,84 @@
+/// @author Jakub Semric
+/// 2018
+
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <stdexcept>
+#include <getopt.h>
+
+#include "nfa.hpp"
+#include "simulation.hpp"
+
+using namespace reduction;
+using namespace std;
+
+const char *helpstr =
+"Usage: ./nfa_min [OPTIONS] NFA OUTPUT\n"
+"Language preserving reduction of NFA in the .fa format. Useless states are\n"
+"removed and states equivalent wrt forward and backward simulation are\n"
+"merged, transitions to states simulated by another successor over the same\n"
+"symbol are removed. Each final state keeps its rule, i.e. the set of words\n"
+"reaching each final state does not change.\n"
+"\noptions:\n"
+"  -h            : show this help and exit\n"
+"  -f            : use only forward simulation\n"
+"  -b            : use only backward simulation\n";
+
+int main(int argc, char **argv)
+{
+    bool forward = true, backward = true;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "hfb")) != -1) {
+            switch (c) {
+                case 'h':
+                    cerr << helpstr;
+                    return 0;
+                case 'f':
+                    backward = false;
+                    break;
+                case 'b':
+                    forward = false;
+                    break;
+                default:
+                    return 1;
+            }
+        }
+
+        if (argc - optind < 2)
+            throw runtime_error("2 arguments required: NFA OUTPUT");
+        if (!forward && !backward)
+            throw runtime_error("-f and -b cannot be combined");
+
+        auto start = chrono::steady_clock::now();
+        Nfa nfa = Nfa::read_from_file(argv[optind]);
+        size_t states = nfa.state_count();
+        size_t trans = NfaArray(nfa).trans_count();
+
+        minimize(nfa, forward, backward);
+
+        ofstream out{argv[optind + 1]};
+        if (!out.is_open())
+            throw runtime_error("cannot open output file");
+        nfa.print(out);
+        out.close();
+        if (!out)
+            throw runtime_error("cannot write output file");
+
+        double sec = chrono::duration<double>(
+            chrono::steady_clock::now() - start).count();
+        cerr << "states    : " << states << " -> " << nfa.state_count()
+            << endl;
+        cerr << "trans     : " << trans << " -> "
+            << NfaArray(nfa).trans_count() << endl;
+        cerr << "duration  : " << sec << "s" << endl;
+    }
+    catch (exception &e) {
+        cerr << "\033[1;31mERROR\033[0m " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
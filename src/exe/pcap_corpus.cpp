@@ -0,0 +1,193 @@
+/// @author Jakub Semric
+/// 2018
+
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <unordered_set>
+#include <getopt.h>
+
+#include "pcap_reader.hpp"
+
+using namespace std;
+using pcapreader::CorpusHeader;
+using pcapreader::CorpusSource;
+
+const char *helpstr =
+"Usage: ./pcap_corpus [OPTIONS] OUTPUT PCAP...\n"
+"Extract packet payloads of PCAP files into a corpus file, which stores each\n"
+"distinct payload once with the number of its packets in each PCAP file.\n"
+"The corpus can be passed to nfa_eval, state_frequency and prefix_labeling\n"
+"instead of PCAP files, so that repeated experiments match only distinct\n"
+"payloads and do not parse packet headers.\n"
+"\noptions:\n"
+"  -h            : show this help and exit\n"
+"  -c <N>        : packet max count of each PCAP\n";
+
+/// Distinct payloads collected from PCAP files.
+class CorpusBuilder
+{
+private:
+    vector<unsigned char> data;
+    vector<uint64_t> offsets{0};
+    vector<vector<CorpusSource>> sources;
+
+    /// Hash and equality of payloads given by their index, the candidate
+    /// payload is appended to the data before the lookup.
+    struct PayloadHash
+    {
+        const CorpusBuilder &b;
+        size_t operator()(uint64_t i) const
+        {
+            // FNV-1a
+            size_t h = 14695981039346656037ULL;
+            for (uint64_t j = b.offsets[i]; j < b.offsets[i + 1]; j++)
+                h = (h ^ b.data[j]) * 1099511628211ULL;
+            return h;
+        }
+    };
+
+    struct PayloadEqual
+    {
+        const CorpusBuilder &b;
+        bool operator()(uint64_t i, uint64_t j) const
+        {
+            uint64_t len = b.offsets[i + 1] - b.offsets[i];
+            return len == b.offsets[j + 1] - b.offsets[j] &&
+                !memcmp(b.data.data() + b.offsets[i],
+                    b.data.data() + b.offsets[j], len);
+        }
+    };
+
+    unordered_set<uint64_t, PayloadHash, PayloadEqual> index;
+
+public:
+    size_t packets;
+
+    CorpusBuilder() :
+        index(1024, PayloadHash{*this}, PayloadEqual{*this}), packets{0} {}
+
+    /// Adds one packet payload of PCAP file.
+    /// @param pcap index of PCAP file
+    void add(const unsigned char *payload, unsigned len, uint32_t pcap)
+    {
+        packets++;
+        data.insert(data.end(), payload, payload + len);
+        offsets.push_back(data.size());
+
+        auto res = index.insert(offsets.size() - 2);
+        if (res.second) {
+            sources.push_back(vector<CorpusSource>{CorpusSource{pcap, 1}});
+            return;
+        }
+
+        // already stored, the candidate is removed
+        offsets.pop_back();
+        data.resize(offsets.back());
+        auto &src = sources[*res.first];
+        if (src.back().pcap == pcap)
+            src.back().count++;
+        else
+            src.push_back(CorpusSource{pcap, 1});
+    }
+
+    size_t size() const { return sources.size();}
+    size_t bytes() const { return data.size();}
+
+    /// Writes the corpus in the format read by pcapreader::PayloadCorpus.
+    void write(ostream &out, const vector<string> &pcaps) const
+    {
+        vector<uint64_t> source_offsets{0}, counts;
+        for (auto &i : sources) {
+            source_offsets.push_back(source_offsets.back() + i.size());
+            uint64_t n = 0;
+            for (auto &j : i)
+                n += j.count;
+            counts.push_back(n);
+        }
+
+        string names;
+        for (auto &i : pcaps)
+            names.append(i.c_str(), i.size() + 1);
+
+        CorpusHeader h;
+        memcpy(h.magic, pcapreader::corpus_magic, sizeof(h.magic));
+        h.version = pcapreader::corpus_version;
+        h.pcap_count = pcaps.size();
+        h.payload_count = sources.size();
+        h.source_count = source_offsets.back();
+        h.data_size = data.size();
+        h.names_size = names.size();
+
+        auto write = [&out](const void *p, size_t size) {
+            out.write(static_cast<const char*>(p), size);
+        };
+        write(&h, sizeof(h));
+        write(offsets.data(), offsets.size() * sizeof(uint64_t));
+        write(source_offsets.data(), source_offsets.size() * sizeof(uint64_t));
+        write(counts.data(), counts.size() * sizeof(uint64_t));
+        for (auto &i : sources)
+            write(i.data(), i.size() * sizeof(CorpusSource));
+        write(data.data(), data.size());
+        write(names.data(), names.size());
+    }
+};
+
+int main(int argc, char **argv)
+{
+    unsigned long cnt = ~0UL;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "hc:")) != -1) {
+            switch (c) {
+                case 'h':
+                    cerr << helpstr;
+                    return 0;
+                case 'c':
+                    cnt = stoul(optarg);
+                    break;
+                default:
+                    return 1;
+            }
+        }
+
+        if (argc - optind < 2)
+            throw runtime_error("OUTPUT and at least one PCAP required");
+
+        string outfile = argv[optind];
+        vector<string> pcaps(argv + optind + 1, argv + argc);
+        CorpusBuilder corpus;
+        for (uint32_t i = 0; i < pcaps.size(); i++) {
+            if (pcapreader::PayloadCorpus::is_corpus(pcaps[i].c_str()))
+                throw runtime_error("'" + pcaps[i] + "' is already a corpus");
+
+            pcapreader::process_payload_mmap(
+                pcaps[i].c_str(),
+                [&] (const unsigned char *payload, unsigned len)
+                {
+                    corpus.add(payload, len, i);
+                }, cnt);
+        }
+
+        ofstream out{outfile, ios::binary};
+        if (!out.is_open())
+            throw runtime_error("cannot open output file");
+        corpus.write(out, pcaps);
+        out.close();
+        if (!out)
+            throw runtime_error("cannot write output file");
+
+        cerr << "packets   : " << corpus.packets << endl;
+        cerr << "payloads  : " << corpus.size() << endl;
+        cerr << "bytes     : " << corpus.bytes() << endl;
+    }
+    catch (exception &e) {
+        cerr << "\033[1;31mERROR\033[0m " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
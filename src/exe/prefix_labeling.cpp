@@ -1,92 +1,357 @@
 #include <iostream>
 #include <fstream>
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <thread>
+#include <getopt.h>
 
 #include "pcap_reader.hpp"
 #include "nfa.hpp"
+#include "prefix_set.hpp"
 
 using namespace reduction;
 using namespace std;
 
-vector<vector<size_t>> label_with_prefix(const NfaArray &nfa, string pcap)
+const char *helpstr =
+"Usage: ./prefix_labeling [OPTIONS] NFA PCAP [TH]\n"
+"Output groups of states labeled by similar sets of packet prefixes.\n"
+"A pair of states is output if the number of common prefixes is greater than\n"
+"TH percent of the larger set, default 0.75.\n"
+"PCAP may be also a corpus created by pcap_corpus, each distinct payload is\n"
+"then labeled once.\n"
+"\noptions:\n"
+"  -h            : show this help and exit\n"
+"  -l            : compare only candidate pairs found by locality-sensitive\n"
+"                  hashing of MinHash signatures, approximate but fast\n"
+"  -b <N>        : number of LSH bands\n"
+"  -r <N>        : number of MinHash values per band\n"
+"  -n <NWORKERS> : number of threads labeling parts of PCAP in parallel\n"
+"  -m <MB>       : max. memory of prefix labels, packets above the limit are\n"
+"                  skipped\n";
+
+/// Max. number of packets in one chunk of PCAP.
+const unsigned long chunk_size = 4096;
+
+/// Labels states by prefixes of packets in a range of chunks.
+/// @param state_labels prefix sets of states, prefixes are numbered from 0
+/// @param mem_limit max. memory of the sets in bytes, packets above it are
+/// skipped
+/// @return number of prefixes
+size_t label_chunks(
+    const NfaArray &nfa, const string &pcap,
+    const vector<pcapreader::PcapChunk> &chunks, size_t first, size_t last,
+    vector<PrefixSet> &state_labels, size_t mem_limit, size_t &mem_used,
+    size_t &skipped)
 {
-    // each state marked with prefix
-    vector<vector<size_t>> state_labels(nfa.state_count());
     // we distinguish the prefixes by some integral value
     size_t prefix = 0;
-    pcapreader::process_payload(
-        pcap.c_str(),
-        [&] (const unsigned char *payload, unsigned len)
-        {
-            if (nfa.accept(payload, len) == false)
+    ScanContext ctx(nfa);
+    pcapreader::ChunkReader reader(pcap.c_str());
+    for (size_t i = first; i < last; i++) {
+        pcapreader::process_payload_chunk(
+            reader, chunks[i],
+            [&] (const unsigned char *payload, unsigned len)
             {
-                nfa.parse_word(payload, len,
-                    [&state_labels, &prefix](State s)
-                    {
-                        // insert to a vector only once at max
-                        if (state_labels[s].empty() ||
-                            state_labels[s].back() != prefix)
+                if (mem_used > mem_limit) {
+                    skipped++;
+                    return;
+                }
+
+                if (ctx.accept(payload, len) == false)
+                {
+                    ctx.parse_word(payload, len,
+                        [&](State s)
                         {
-                            state_labels[s].push_back(prefix);
-                        }
-                    },
-                    [&prefix]() {prefix++;});
-            }
-        });
+                            // insert to a set only once at max
+                            auto &labels = state_labels[s];
+                            if (labels.empty() || labels.back() != prefix)
+                                mem_used += labels.push_back(prefix);
+                        },
+                        [&prefix]() {prefix++;});
+                }
+            });
+    }
+
+    return prefix;
+}
+
+/// Labels each state by the prefixes of not accepted packets which visited
+/// it. The capture is split into ranges of chunks labeled in parallel, each
+/// range numbers its prefixes from 0 and the sets are concatenated in the
+/// order of ranges at the end.
+/// @param nworkers number of threads
+/// @param mem_limit max. memory of prefix sets in MB, 0 for no limit
+vector<PrefixSet> label_with_prefix(
+    const NfaArray &nfa, const string &pcap, unsigned nworkers,
+    size_t mem_limit)
+{
+    auto chunks = pcapreader::index_pcap(pcap.c_str(), chunk_size);
+    nworkers = max<size_t>(1, min<size_t>(nworkers, chunks.size()));
+    size_t limit = mem_limit ? (mem_limit << 20) / nworkers : ~0UL;
+
+    vector<vector<PrefixSet>> labels(
+        nworkers, vector<PrefixSet>(nfa.state_count()));
+    vector<size_t> prefixes(nworkers), mem_used(nworkers), skipped(nworkers);
+    vector<future<void>> workers;
+    for (unsigned i = 0; i < nworkers; i++) {
+        workers.push_back(async(launch::async, [&, i] () {
+            prefixes[i] = label_chunks(
+                nfa, pcap, chunks, chunks.size() * i / nworkers,
+                chunks.size() * (i + 1) / nworkers, labels[i], limit,
+                mem_used[i], skipped[i]);
+        }));
+    }
+    for (auto &i : workers)
+        i.get();
+
+    // merge ranges, prefixes of a range follow the prefixes of previous ones
+    auto &state_labels = labels[0];
+    size_t offset = prefixes[0];
+    for (unsigned i = 1; i < nworkers; i++) {
+        for (size_t s = 0; s < state_labels.size(); s++) {
+            state_labels[s].append(labels[i][s], offset);
+            labels[i][s].clear();
+        }
+        offset += prefixes[i];
+    }
+
+    size_t mem = 0, values = 0, total_skipped = 0;
+    for (auto &i : state_labels) {
+        i.shrink_to_fit();
+        mem += i.memory();
+        values += i.size();
+    }
+    for (auto i : skipped)
+        total_skipped += i;
+
+    cerr << "prefixes  : " << offset << endl;
+    cerr << "labels    : " << values << endl;
+    cerr << "memory    : " << mem << " B (" << mem * 1.0 / max<size_t>(1, values)
+        << " B per label)" << endl;
+    if (total_skipped) {
+        cerr << "skipped   : " << total_skipped
+            << " packets over the memory limit" << endl;
+    }
 
     return state_labels;
 }
 
+/// Decides whether two sorted sets of prefixes are similar.
+/// @param th min. percentage of common prefixes in the larger set
+bool similar(const PrefixSet &a, const PrefixSet &b, float th)
+{
+    size_t cnt = PrefixSet::intersection_count(a, b);
+    if (cnt == 0)
+        return false;
 
-int main(int argc, char **argv)
+    size_t denom = max(a.size(), b.size());
+    float sim_rate = cnt * 100.0 / denom;
+    return sim_rate > th;
+}
+
+/// Chooses LSH parameters for the threshold. Two states pass the threshold
+/// only if their Jaccard similarity is at least j = t / (2 - t), where t is
+/// the threshold as a fraction. A pair with similarity j becomes a candidate
+/// with probability 1 - (1 - j^rows)^bands, the most rows are chosen for
+/// which the probability is at least 95%.
+/// @param th threshold in percent
+/// @param bands number of bands
+/// @param rows number of MinHash values per band
+void lsh_params(float th, unsigned &bands, unsigned &rows)
 {
-    if (argc < 3) {
-        cerr << "Error: 2 arguments required NFA and PCAP\n";
-        return 1;
+    const unsigned max_hashes = 1024;
+    const double recall = 0.95;
+    double t = th / 100;
+    double j = t / (2 - t);
+    for (rows = max_hashes; rows > 1; rows--) {
+        bands = max_hashes / rows;
+        if (1 - pow(1 - pow(j, rows), bands) >= recall)
+            return;
     }
+    rows = 1;
+    bands = min<double>(max_hashes, ceil(log(1 - recall) / log(1 - j)));
+}
 
-    float th = 0.75;
-    if (argc > 3)
-        th = stod(argv[3]);
-    assert(th > 0 && th <= 1);
-
-    cerr << "labeling states with prefixes\n";
-    NfaArray nfa(Nfa::read_from_file(argv[1]));
-    auto state_labels = label_with_prefix(nfa, argv[2]);
-    auto state_map = nfa.get_reversed_state_map();
+/// 64-bit mixing function, finalizer of MurmurHash3.
+inline uint64_t mix(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
 
-    // empty sets eq. group
+/// Finds candidate pairs of states with similar sets of prefixes. Each state
+/// gets a MinHash signature of bands * rows values computed by one
+/// permutation hashing with densification, states with the same
+/// values in a band fall into the same bucket and all pairs within a bucket
+/// are candidates.
+/// @param state_labels sorted sets of prefixes of each state
+/// @return sorted pairs of state indexes (i, j), i < j
+vector<pair<uint32_t,uint32_t>> lsh_candidates(
+    const vector<PrefixSet> &state_labels, unsigned bands, unsigned rows)
+{
+    size_t nhashes = bands * rows;
+    vector<uint32_t> states;
     for (size_t i = 0; i < state_labels.size(); i++) {
-        if (state_labels[i].empty()) {
-            cout << state_map.at(i) << " ";
+        if (!state_labels[i].empty())
+            states.push_back(i);
+    }
+
+    // one permutation hashing, each prefix is hashed once into one of
+    // the bins, the signature consists of min. hashes of the bins
+    vector<uint64_t> sig(states.size() * nhashes);
+    vector<uint32_t> bins(nhashes);
+    for (size_t i = 0; i < states.size(); i++) {
+        fill(bins.begin(), bins.end(), ~0U);
+        state_labels[states[i]].for_each([&](uint64_t prefix) {
+            uint64_t h = mix(prefix);
+            size_t bin = (h >> 32) * nhashes >> 32;
+            bins[bin] = min<uint32_t>(bins[bin], h);
+        });
+
+        // empty bins borrow the value of the next non-empty bin together
+        // with the distance to it
+        uint64_t *row = &sig[i * nhashes];
+        size_t next = nhashes;
+        for (size_t k = 2 * nhashes; k-- > 0; ) {
+            if (bins[k % nhashes] != ~0U)
+                next = k;
+            if (k < nhashes)
+                row[k] = static_cast<uint64_t>(next - k) << 32 |
+                    bins[next % nhashes];
         }
     }
-    cout << endl;
 
-    // eq. pairs wrt the threshold th
-    for (size_t i = 0; i < state_labels.size(); i++) {
-        if (state_labels[i].empty()) {
-            continue;
+    vector<pair<uint32_t,uint32_t>> candidates;
+    vector<pair<uint64_t,uint32_t>> buckets(states.size());
+    for (unsigned b = 0; b < bands; b++) {
+        for (size_t i = 0; i < states.size(); i++) {
+            uint64_t h = b;
+            const uint64_t *band = &sig[i * nhashes + b * rows];
+            for (unsigned r = 0; r < rows; r++)
+                h = mix(h ^ band[r]);
+            buckets[i] = make_pair(h, states[i]);
+        }
+
+        sort(buckets.begin(), buckets.end());
+        for (size_t first = 0, last; first < buckets.size(); first = last) {
+            for (last = first + 1; last < buckets.size() &&
+                buckets[last].first == buckets[first].first; last++)
+            {
+                for (size_t i = first; i < last; i++)
+                    candidates.push_back(
+                        make_pair(buckets[i].second, buckets[last].second));
+            }
+        }
+    }
+
+    sort(candidates.begin(), candidates.end());
+    candidates.erase(
+        unique(candidates.begin(), candidates.end()), candidates.end());
+    return candidates;
+}
+
+int main(int argc, char **argv)
+{
+    bool lsh = false;
+    unsigned bands = 0, rows = 0;
+    unsigned nworkers = 1;
+    size_t mem_limit = 0;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "hlb:r:n:m:")) != -1) {
+            switch (c) {
+                case 'h':
+                    cerr << helpstr;
+                    return 0;
+                case 'l':
+                    lsh = true;
+                    break;
+                case 'b':
+                    bands = stoul(optarg);
+                    break;
+                case 'r':
+                    rows = stoul(optarg);
+                    break;
+                case 'n':
+                    nworkers = stoul(optarg);
+                    break;
+                case 'm':
+                    mem_limit = stoul(optarg);
+                    break;
+                default:
+                    return 1;
+            }
         }
 
-        for (size_t j = i + 1; j < state_labels.size(); j++) {
-            // compute the intersection
-            // vectors are supposed to be sorted
-            vector<size_t> res(state_labels[i].size());
-            auto it = set_intersection(
-                state_labels[i].begin(), state_labels[i].end(),
-                state_labels[j].begin(), state_labels[j].end(), res.begin()
-            );
-            if (it != res.begin()) {
-                int denom = max(state_labels[i].size(), state_labels[j].size());
-                int cnt = it - res.begin();
-                float sim_rate = cnt * 100.0 / denom;
-                if (sim_rate > th) {
+        if (argc - optind < 2) {
+            cerr << "Error: 2 arguments required NFA and PCAP\n";
+            return 1;
+        }
+
+        float th = 0.75;
+        if (argc - optind > 2)
+            th = stod(argv[optind + 2]);
+        assert(th > 0 && th <= 1);
+
+        cerr << "labeling states with prefixes\n";
+        NfaArray nfa = NfaArray::load(argv[optind]);
+        nworkers = min(nworkers, thread::hardware_concurrency());
+        auto state_labels = label_with_prefix(
+            nfa, argv[optind + 1], max(nworkers, 1U), mem_limit);
+        auto state_map = nfa.get_reversed_state_map();
+
+        // empty sets eq. group
+        for (size_t i = 0; i < state_labels.size(); i++) {
+            if (state_labels[i].empty()) {
+                cout << state_map.at(i) << " ";
+            }
+        }
+        cout << endl;
+
+        // eq. pairs wrt the threshold th
+        if (lsh) {
+            unsigned b, r;
+            lsh_params(th, b, r);
+            bands = bands ? bands : b;
+            rows = rows ? rows : r;
+            auto candidates = lsh_candidates(state_labels, bands, rows);
+            cerr << "candidates: " << candidates.size() << " (" << bands
+                << " bands x " << rows << " rows)\n";
+
+            for (auto i : candidates) {
+                if (similar(state_labels[i.first], state_labels[i.second], th))
+                {
+                    cout << state_map.at(i.first) << " "
+                        << state_map.at(i.second) << endl;
+                }
+            }
+            return 0;
+        }
+
+        for (size_t i = 0; i < state_labels.size(); i++) {
+            if (state_labels[i].empty()) {
+                continue;
+            }
+
+            for (size_t j = i + 1; j < state_labels.size(); j++) {
+                // vectors are supposed to be sorted
+                if (similar(state_labels[i], state_labels[j], th)) {
                     cout << state_map.at(i) << " " << state_map.at(j) << endl;
                 }
             }
         }
     }
+    catch (exception &e) {
+        cerr << "\033[1;31mERROR\033[0m " << e.what() << endl;
+        return 1;
+    }
 
     return 0;
 }
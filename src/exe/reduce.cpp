@@ -0,0 +1,161 @@
+/// @author Jakub Semric
+/// 2018
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <stdexcept>
+#include <thread>
+#include <getopt.h>
+
+#include "nfa.hpp"
+#include "reduction.hpp"
+#include "state_freq.hpp"
+
+using namespace reduction;
+using namespace std;
+
+const char *helpstr =
+"Usage: ./reduce [OPTIONS] NFA [PCAP...]\n"
+"Approximate reduction of NFA based on packet frequency of states computed\n"
+"over PCAP files.\n"
+"\noptions:\n"
+"  -h            : show this help and exit\n"
+"  -o <FILE>     : specify the output file, default output.fa, with more\n"
+"                  ratios the ratio is inserted before the extension\n"
+"  -r <RATIOS>   : comma separated reduction ratios, default 0.2\n"
+"  -m            : merging reduction before pruning\n"
+"  -t <N>        : threshold for merging, default 0.995\n"
+"  -x <N>        : max frequency of a state allowed to be merged, default 0.1\n"
+"  -f <FILE>     : read state frequencies from FILE instead of PCAP files\n"
+"  -n <NWORKERS> : number of threads computing frequencies\n";
+
+/// Reads frequencies in the format of state_frequency, i.e. lines
+/// "<state> <freq>", the rest of the line and comments are ignored.
+map<State, size_t> read_freq(const string &fname)
+{
+    ifstream in{fname};
+    if (!in.is_open())
+        throw runtime_error("cannot open frequency file");
+
+    map<State, size_t> freq;
+    string line;
+    while (getline(in, line)) {
+        line = line.substr(0, line.find('#'));
+        istringstream ss{line};
+        State s;
+        size_t f;
+        if (ss >> s >> f)
+            freq[s] = f;
+    }
+
+    return freq;
+}
+
+/// Inserts ratio before the extension of the output file.
+string output_name(const string &fname, const string &ratio)
+{
+    auto dot = fname.rfind('.');
+    auto slash = fname.rfind('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+        return fname + "." + ratio;
+    return fname.substr(0, dot) + "." + ratio + fname.substr(dot);
+}
+
+int main(int argc, char **argv)
+{
+    string outfile = "output.fa", freq_file;
+    vector<string> ratios{"0.2"};
+    bool merge = false;
+    double th = .995, max_fr = .1;
+    unsigned nworkers = 1;
+    int c;
+
+    try {
+        while ((c = getopt(argc, argv, "ho:r:mt:x:f:n:")) != -1) {
+            switch (c) {
+                case 'h':
+                    cerr << helpstr;
+                    return 0;
+                case 'o':
+                    outfile = optarg;
+                    break;
+                case 'r': {
+                    ratios.clear();
+                    istringstream ss{optarg};
+                    string r;
+                    while (getline(ss, r, ','))
+                        ratios.push_back(r);
+                    break;
+                }
+                case 'm':
+                    merge = true;
+                    break;
+                case 't':
+                    th = stod(optarg);
+                    break;
+                case 'x':
+                    max_fr = stod(optarg);
+                    break;
+                case 'f':
+                    freq_file = optarg;
+                    break;
+                case 'n':
+                    nworkers = stoul(optarg);
+                    break;
+                default:
+                    return 1;
+            }
+        }
+
+        if (argc - optind < 1 || (freq_file == "" && argc - optind < 2))
+            throw runtime_error("NFA and PCAP or frequency file required");
+
+        Nfa nfa = Nfa::read_from_file(argv[optind]);
+        map<State, size_t> freq;
+        if (freq_file != "") {
+            freq = read_freq(freq_file);
+        }
+        else {
+            vector<string> pcaps(argv + optind + 1, argv + argc);
+            NfaArray nfa_arr(nfa);
+            nworkers = max(1U, min(nworkers, thread::hardware_concurrency()));
+            auto state_freq = compute_state_freq(nfa_arr, pcaps, nworkers);
+            for (StateIdx i = 0; i < state_freq.size(); i++)
+                freq[nfa_arr.get_state_label(i)] = state_freq[i];
+        }
+
+        for (auto s : nfa.get_states()) {
+            if (!freq.count(s))
+                throw runtime_error("missing frequency of a state");
+        }
+
+        size_t cnt = nfa.state_count(), m = 0;
+        if (merge) {
+            m = merging(nfa, freq, th, max_fr);
+            cerr << "states merged: " << m << endl;
+        }
+
+        for (auto &r : ratios) {
+            double ratio = stod(r);
+            cerr << "reduction ratio: " << ratio << endl;
+            Nfa reduced{nfa};
+            pruning(reduced, ratio * cnt / (cnt - m), freq);
+
+            string fname = ratios.size() > 1 ? output_name(outfile, r) : outfile;
+            ofstream out{fname};
+            if (!out.is_open())
+                throw runtime_error("cannot open output file");
+            reduced.print(out);
+            cerr << "saved as " << fname << endl;
+        }
+    }
+    catch (exception &e) {
+        cerr << "\033[1;31mERROR\033[0m " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
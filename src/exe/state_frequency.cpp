@@ -5,10 +5,19 @@
 #include <ostream>
 #include <vector>
 #include <map>
+#include <memory>
+#include <random>
+#include <cmath>
+#include <algorithm>
+#include <thread>
 #include <getopt.h>
 
 #include "nfa.hpp"
+#include "lazy_dfa.hpp"
 #include "pcap_reader.hpp"
+#include "pipeline.hpp"
+#include "flow_matcher.hpp"
+#include "state_freq.hpp"
 
 using namespace reduction;
 using namespace std;
@@ -18,38 +27,231 @@ using namespace std;
 #define AFLAG_NIN_LANG 0
 
 const char *helpstr =
-"Usage: ./state_frequency [OPTIONS] NFA PCAP OUTPUT\n"
-"Compute packet frequency for each state.\n"
+"Usage: ./state_frequency [OPTIONS] NFA PCAP... OUTPUT\n"
+"Compute packet frequency for each state over all PCAP files.\n"
+"PCAP may be also a corpus created by pcap_corpus, each distinct payload is\n"
+"then matched once and counted by the number of its packets.\n"
 "\noptions:\n"
 "  -h            : show this help and exit\n"
-"  -c <N>        : packet max count\n"
-"  -a <N>        : 1 - only accepted, 0 - not accepted, default both\n";
+"  -c <N>        : packet max count of each PCAP, PCAP files are then read\n"
+"                  by one thread, it cannot be used with a corpus\n"
+"  -n <NWORKERS> : number of threads, PCAP files are split into chunks\n"
+"  -S <RATE>     : sampling mode, estimate frequencies from packets sampled\n"
+"                  with probability RATE, output also 95% confidence bounds\n"
+"  -f            : sample whole flows instead of packets\n"
+"  -e <TOL>      : read PCAP in random order and stop once the ranking of\n"
+"                  states by frequency changes by at most TOL (0-1)\n"
+"  -a <N>        : 1 - only accepted, 0 - not accepted, default both\n"
+"  -l <MB>       : simulate NFA by lazy DFA with cache of at most MB megabytes\n"
+"  -p <N>        : pipeline mode, PCAP is read by one thread and matched by N\n"
+"                  threads\n"
+"  -s <MB>       : stream mode, TCP segments continue the simulation of their\n"
+"                  flow, flow table has at most MB megabytes\n"
+"  -m            : rule mode, for each final state output the number of\n"
+"                  packets matching it and the total number of its matches,\n"
+"                  cannot be combined with -l, -n, -p or -s\n"
+"  --profile <FILE> : print a profile of the simulation of NFA and time of\n"
+"                  processing stages, and write it to FILE in JSON, requires\n"
+"                  a build with make PROFILE=1\n";
 
-map<State, unsigned long> compute_freq(
-    const Nfa &nfa, pcap_t *pcap, int aflag = AFLAG_BOTH, size_t count=~0UL)
-{
-    map<State, unsigned long> freq;
-    NfaArray m(nfa);
-    vector<size_t> state_freq(nfa.state_count());
+/// Value returned by getopt_long for --profile.
+const int profile_opt = 256;
 
-    pcapreader::process_payload(
-        pcap,
-        [&] (const unsigned char *payload, unsigned len)
-        {
-            if (aflag >= AFLAG_BOTH) {
-                m.label_states(state_freq, payload, len);                
+const option long_options[] = {
+    {"profile", required_argument, nullptr, profile_opt},
+    {nullptr, 0, nullptr, 0}
+};
+
+/// Maximal number of packets read at once.
+const size_t batch_size = 64;
+/// Max. number of packets in one chunk of work.
+const unsigned long chunk_size = 4096;
+
+template<typename Matcher>
+void compute_freq(
+    Matcher &m, StateFreq &state_freq,
+    const pcapreader::PayloadBatch &batch, int aflag)
+{
+    NFA_PROFILE_STAGE(timer, "match");
+    for (size_t i = 0; i < batch.size(); i++) {
+        auto payload = batch.payloads[i];
+        auto len = batch.lengths[i];
+        if (aflag >= AFLAG_BOTH) {
+            m.label_states(state_freq, payload, len, batch.count(i));
+        }
+        else {
+            // only accepted or ~accepted
+            if (m.accept(payload, len) == aflag) {
+                m.label_states(state_freq, payload, len, batch.count(i));
             }
-            else {
-                // only accepted or ~accepted
-                if (m.accept(payload, len) == 1) {
-                    m.label_states(state_freq, payload, len);
-                }
+        }
+    }
+}
+
+void compute_freq(
+    LazyDfa &dfa, StateFreq &state_freq,
+    const pcapreader::PayloadBatch &batch, int aflag)
+{
+    NFA_PROFILE_STAGE(timer, "match");
+    size_t counts[LazyDfa::batch_size];
+    for (size_t i = 0; i < batch.size(); i += LazyDfa::batch_size) {
+        const Word *payloads = batch.payloads.data() + i;
+        const unsigned *lengths = batch.lengths.data() + i;
+        size_t n = min(batch.size() - i, LazyDfa::batch_size);
+        // payloads of a corpus are weighted by the number of their packets
+        size_t *weights = batch.corpus ? counts : nullptr;
+        if (aflag >= AFLAG_BOTH) {
+            for (size_t j = 0; weights && j < n; j++)
+                counts[j] = batch.count(i + j);
+            dfa.label_states_batch(state_freq, payloads, lengths, n, weights);
+            continue;
+        }
+
+        // only accepted or ~accepted
+        bool accepted[LazyDfa::batch_size];
+        dfa.accept_batch(payloads, lengths, n, accepted);
+
+        Word words[LazyDfa::batch_size];
+        unsigned accepted_lengths[LazyDfa::batch_size];
+        size_t m = 0;
+        for (size_t j = 0; j < n; j++) {
+            if (accepted[j] == (aflag == AFLAG_IN_LANG)) {
+                counts[m] = batch.count(i + j);
+                words[m] = payloads[j];
+                accepted_lengths[m++] = lengths[j];
             }
+        }
+        dfa.label_states_batch(
+            state_freq, words, accepted_lengths, m, weights);
+    }
+}
+
+template<typename Matcher>
+void compute_freq(
+    Matcher &m, StateFreq &state_freq, const string &pcap, int aflag,
+    size_t count)
+{
+    pcapreader::process_payload_mmap_batch(
+        pcap.c_str(),
+        [&] (const pcapreader::PayloadBatch &batch)
+        {
+            compute_freq(m, state_freq, batch, aflag);
+        }, batch_size, count);
+}
+
+/// Computes frequencies in the pipeline mode, payloads are read by
+/// the calling thread and matched by one thread per matcher.
+template<typename Matcher>
+void compute_freq_pipeline(
+    const vector<Matcher*> &matchers, StateFreq &state_freq,
+    const vector<string> &pcaps, int aflag, size_t count)
+{
+    vector<StateFreq> freq(matchers.size(), StateFreq(state_freq.size()));
+    pcapreader::PipelineCounters counters;
+
+    pcapreader::process_payload_pipeline(
+        pcaps,
+        [&] (unsigned worker, size_t, const pcapreader::PayloadBatch &batch)
+        {
+            compute_freq(*matchers[worker], freq[worker], batch, aflag);
+        }, matchers.size(), batch_size, count, &counters);
+
+    for (auto &i : freq) {
+        for (size_t j = 0; j < state_freq.size(); j++)
+            state_freq[j] += i[j];
+    }
+    counters.print(cerr);
+}
+
+/// Computes frequencies in the stream mode, the simulation of each TCP flow
+/// continues over its segments.
+void compute_freq_stream(
+    const NfaArray &m, StateFreq &state_freq, const string &pcap,
+    int aflag, size_t count, size_t flow_mem)
+{
+    FlowMatcher matcher(m, flow_mem);
+    pcapreader::process_flow_payload(
+        pcap.c_str(),
+        [&] (const pcapreader::PacketInfo &info, const unsigned char *payload,
+            unsigned len)
+        {
+            matcher.label_states(
+                state_freq, info, payload, len,
+                aflag >= AFLAG_BOTH ? -1 : aflag);
         }, count);
 
+    matcher.get_counters().print(cerr);
+}
+
+/// Computes frequencies by the given matchers, one per thread.
+template<typename Matcher>
+void compute_freq(
+    const vector<Matcher*> &matchers, StateFreq &state_freq,
+    const vector<string> &pcaps, int aflag, size_t count, bool pipeline)
+{
+    if (pipeline) {
+        compute_freq_pipeline(matchers, state_freq, pcaps, aflag, count);
+    }
+    else if (count != ~0UL) {
+        // packet count is known only after reading, read PCAP files in turn
+        for (auto &pcap : pcaps)
+            compute_freq(*matchers[0], state_freq, pcap, aflag, count);
+    }
+    else {
+        compute_freq_parallel(
+            matchers, state_freq, pcaps,
+            [aflag] (Matcher &m, StateFreq &freq,
+                const pcapreader::PayloadBatch &batch)
+            {
+                compute_freq(m, freq, batch, aflag);
+            }, chunk_size, batch_size);
+    }
+}
+
+/// Computes packet frequency of each state.
+/// @param pcaps PCAP files, frequencies are summed over all of them
+/// @param count max. number of packets of each PCAP file
+/// @param nworkers number of matching threads
+/// @param pipeline if set, PCAP files are read by a separate thread
+map<State, unsigned long> compute_freq(
+    const NfaArray &m, const vector<string> &pcaps, int aflag = AFLAG_BOTH,
+    size_t count=~0UL, size_t lazy_dfa_mem = 0, unsigned nworkers = 1,
+    bool pipeline = false, size_t flow_mem = 0)
+{
+    map<State, unsigned long> freq;
+    StateFreq state_freq(m.state_count());
+
+    if (flow_mem) {
+        for (auto &pcap : pcaps)
+            compute_freq_stream(m, state_freq, pcap, aflag, count, flow_mem);
+    }
+    else if (lazy_dfa_mem) {
+        vector<unique_ptr<LazyDfa>> dfas;
+        vector<LazyDfa*> matchers;
+        for (unsigned i = 0; i < nworkers; i++) {
+            dfas.emplace_back(new LazyDfa(m, lazy_dfa_mem));
+            matchers.push_back(dfas.back().get());
+        }
+        compute_freq(matchers, state_freq, pcaps, aflag, count, pipeline);
+
+        LazyDfaCounters counters;
+        for (auto i : matchers)
+            counters.aggregate(i->get_counters());
+        counters.print(cerr);
+    }
+    else {
+        vector<unique_ptr<ScanContext>> contexts;
+        vector<ScanContext*> matchers;
+        for (unsigned i = 0; i < nworkers; i++) {
+            contexts.emplace_back(new ScanContext(m));
+            matchers.push_back(contexts.back().get());
+        }
+        compute_freq(matchers, state_freq, pcaps, aflag, count, pipeline);
+    }
+
     // remap frequencies
     auto state_map = m.get_reversed_state_map();
-    for (unsigned long i = 0; i < nfa.state_count(); i++)
+    for (unsigned long i = 0; i < m.state_count(); i++)
     {
         freq[state_map[i]] = state_freq[i];
     }
@@ -57,15 +259,207 @@ map<State, unsigned long> compute_freq(
     return freq;
 }
 
-map<State, unsigned long> compute_freq(
-    const Nfa &nfa, string fname, int aflag = AFLAG_BOTH, size_t count=~0UL)
+/// Estimate of packet frequency of a state with 95% confidence bounds.
+struct FreqEstimate
+{
+    double freq;
+    double low;
+    double high;
+};
+
+/// Ranks states by frequency, states with the same frequency get the average
+/// of their ranks.
+vector<double> rank_states(const StateFreq &freq)
+{
+    vector<size_t> order(freq.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    sort(order.begin(), order.end(),
+        [&freq](size_t a, size_t b) { return freq[a] > freq[b];});
+
+    vector<double> rank(freq.size());
+    for (size_t first = 0, last; first < order.size(); first = last) {
+        for (last = first + 1; last < order.size() &&
+            freq[order[last]] == freq[order[first]]; last++)
+            ;
+        for (size_t i = first; i < last; i++)
+            rank[order[i]] = (first + last - 1) / 2.0;
+    }
+
+    return rank;
+}
+
+/// Spearman's footrule distance of two rankings normalized to [0, 1].
+double ranking_distance(const vector<double> &a, const vector<double> &b)
 {
-    char err_buf[4096] = "";
-    pcap_t *pcap;
-    if (!(pcap = pcap_open_offline(fname.c_str(), err_buf)))
-        throw std::ios_base::failure("cannot open pcap file '" + fname + "'");
+    double dist = 0;
+    for (size_t i = 0; i < a.size(); i++)
+        dist += fabs(a[i] - b[i]);
 
-    return compute_freq(nfa, pcap, aflag, count);
+    double n = a.size();
+    return n > 1 ? dist / (n * n / 2) : 0;
+}
+
+/// Estimates frequencies from a sample of packets. Packets are sampled
+/// independently, or whole flows are sampled by the hash of their key. If
+/// tolerance is set, chunks of PCAP files are read in random order and
+/// reading stops once the ranking of states by frequency changes by at most
+/// the tolerance in several subsequent checks. Frequencies and their bounds
+/// are scaled to all packets with payload. The bounds assume independent
+/// packets, so they are too narrow for the sampling of flows.
+/// @param rate probability of sampling a packet or a flow
+/// @param per_flow sample flows instead of packets
+/// @param tol max. ranking distance of stable ranking, 0 to read all packets
+map<State, FreqEstimate> compute_freq_sample(
+    const NfaArray &m, const vector<string> &pcaps, int aflag, double rate,
+    bool per_flow, double tol)
+{
+    // min. number of sampled packets before the first check
+    const size_t min_sample = 1000;
+    // number of subsequent stable checks needed to stop
+    const unsigned stable_checks = 3;
+    // z-score of 95% confidence
+    const double z = 1.96;
+
+    struct SampleTask
+    {
+        size_t pcap;
+        pcapreader::PcapChunk chunk;
+    };
+
+    vector<SampleTask> tasks;
+    unsigned long records = 0;
+    for (size_t i = 0; i < pcaps.size(); i++) {
+        for (auto &c : pcapreader::index_pcap(pcaps[i].c_str(), chunk_size)) {
+            tasks.push_back(SampleTask{i, c});
+            records += c.count;
+        }
+    }
+
+    // fixed seed, so that the results are reproducible
+    mt19937_64 gen(1);
+    uniform_real_distribution<double> uniform(0, 1);
+    if (tol > 0)
+        shuffle(tasks.begin(), tasks.end(), gen);
+
+    ScanContext ctx(m);
+    StateFreq state_freq(m.state_count());
+    vector<double> rank = rank_states(state_freq);
+    size_t sampled = 0, payloads = 0, chunks = 0, next_check = min_sample;
+    unsigned long records_read = 0;
+    unsigned stable = 0;
+
+    // each file is opened once, chunks are visited in random order
+    vector<unique_ptr<pcapreader::ChunkReader>> readers(pcaps.size());
+    for (auto &task : tasks) {
+        auto &reader = readers[task.pcap];
+        if (!reader)
+            reader.reset(new pcapreader::ChunkReader(pcaps[task.pcap].c_str()));
+        pcapreader::process_flow_payload_chunk(
+            *reader, task.chunk,
+            [&] (const pcapreader::PacketInfo &info,
+                const unsigned char *payload, unsigned len)
+            {
+                if (len == 0)
+                    return;
+
+                payloads++;
+                if (per_flow) {
+                    uint64_t h = pcapreader::FlowKeyHash()(info.flow) *
+                        0x9e3779b97f4a7c15ULL;
+                    if (ldexp(h >> 11, -53) >= rate)
+                        return;
+                }
+                else if (uniform(gen) >= rate) {
+                    return;
+                }
+
+                sampled++;
+                if (aflag >= AFLAG_BOTH || ctx.accept(payload, len) == aflag)
+                    ctx.label_states(state_freq, payload, len);
+            });
+
+        chunks++;
+        records_read += task.chunk.count;
+        if (tol > 0 && sampled >= next_check) {
+            next_check = sampled + min_sample;
+            auto new_rank = rank_states(state_freq);
+            stable = ranking_distance(rank, new_rank) <= tol ? stable + 1 : 0;
+            rank.swap(new_rank);
+            if (stable == stable_checks)
+                break;
+        }
+    }
+
+    bool complete = chunks == tasks.size();
+    double total = complete ? payloads : payloads * 1.0 * records / records_read;
+    cerr << "sampled   : " << sampled << " of " << payloads
+        << " packets with payload" << endl;
+    cerr << "read      : " << chunks << " of " << tasks.size() << " chunks"
+        << (complete ? "" : ", ranking is stable") << endl;
+
+    map<State, FreqEstimate> freq;
+    auto state_map = m.get_reversed_state_map();
+    for (unsigned long i = 0; i < m.state_count(); i++) {
+        FreqEstimate &e = freq[state_map[i]];
+        if (sampled == 0) {
+            e = FreqEstimate{0, 0, total};
+            continue;
+        }
+
+        double n = sampled;
+        double p = state_freq[i] / n;
+        e.freq = p * total;
+        if (complete && sampled == payloads) {
+            e.low = e.high = e.freq;
+            continue;
+        }
+
+        // Wilson score interval
+        double center = (p + z * z / (2 * n)) / (1 + z * z / n);
+        double half = z / (1 + z * z / n) *
+            sqrt(p * (1 - p) / n + z * z / (4 * n * n));
+        e.low = max(0.0, center - half) * total;
+        e.high = min(1.0, center + half) * total;
+    }
+
+    return freq;
+}
+
+/// Counts matches of each final state (rule).
+/// @return final state, number of packets matched by it and number of its
+/// matches, i.e. the number of payload offsets at which it is reached
+map<State, pair<size_t,size_t>> compute_matches(
+    const NfaArray &m, const vector<string> &pcaps, size_t count = ~0UL)
+{
+    map<State, pair<size_t,size_t>> res;
+    vector<size_t> packets(m.state_count()), matches(m.state_count());
+    vector<ScanContext::Match> offsets;
+    ScanContext ctx(m);
+
+    for (auto &pcap : pcaps) {
+        pcapreader::process_payload_mmap_batch(
+            pcap.c_str(),
+            [&] (const pcapreader::PayloadBatch &batch)
+            {
+                for (size_t i = 0; i < batch.size(); i++) {
+                    size_t n = batch.count(i);
+                    auto &found = ctx.match(
+                        batch.payloads[i], batch.lengths[i], &offsets);
+                    for (auto s : found)
+                        packets[s] += n;
+                    for (auto j : offsets)
+                        matches[j.first] += n;
+                }
+            }, batch_size, count);
+    }
+
+    for (StateIdx s = 0; s < m.state_count(); s++) {
+        if (m.is_final_idx(s))
+            res[m.get_state_label(s)] = make_pair(packets[s], matches[s]);
+    }
+
+    return res;
 }
 
 int main(int argc, char **argv)
@@ -73,10 +467,18 @@ int main(int argc, char **argv)
     try{
         size_t cnt = ~0UL;
         int aflag = 2;
-        int opt_cnt = 1;
+        size_t lazy_dfa_mem = 0;
+        unsigned nmatchers = 0;
+        unsigned nworkers = 1;
+        size_t flow_mem = 0;
+        bool rules = false;
+        double rate = 0, tol = 0;
+        bool per_flow = false;
+        string profile_file;
         int c;
-        while ((c = getopt(argc, argv, "hc:a:")) != -1) {
-            opt_cnt++;
+        while ((c = getopt_long(
+            argc, argv, "hc:a:l:p:s:mn:S:fe:", long_options, nullptr)) != -1)
+        {
             switch (c) {
                 // general options
                 case 'h':
@@ -84,34 +486,137 @@ int main(int argc, char **argv)
                     return 0;
                 case 'a':
                     aflag = stoi(optarg);
-                    opt_cnt++;
                     break;
                 case 'c':
                     cnt = stoul(optarg);
-                    opt_cnt++;
+                    break;
+                case 'l':
+                    lazy_dfa_mem = stoul(optarg);
+                    break;
+                case 'p':
+                    nmatchers = stoul(optarg);
+                    break;
+                case 's':
+                    flow_mem = stoul(optarg);
+                    break;
+                case 'm':
+                    rules = true;
+                    break;
+                case 'n':
+                    nworkers = stoul(optarg);
+                    break;
+                case 'S':
+                    rate = stod(optarg);
+                    break;
+                case 'f':
+                    per_flow = true;
+                    break;
+                case 'e':
+                    tol = stod(optarg);
+                    break;
+                case profile_opt:
+                    profile_file = optarg;
                     break;
                 default:
                     return 1;
             }
         }
 
-        if (argc > 3) {
+        if (argc - optind >= 3) {
+            if (profile_file != "") {
+                if (!Profiler::available()) {
+                    throw runtime_error(
+                        "--profile requires a build with PROFILE=1");
+                }
+                Profiler::instance().enable();
+            }
+            StageClock clock;
+
             cerr << "computing packet frequency\n";
-            string nfa_str = argv[opt_cnt];
-            string pcap = argv[opt_cnt + 1];
-            Nfa nfa = Nfa::read_from_file(nfa_str);
-            ofstream out{argv[opt_cnt + 2]};
+            string nfa_str = argv[optind];
+            vector<string> pcaps(argv + optind + 1, argv + argc - 1);
+            NfaArray nfa = NfaArray::load(nfa_str);
+            Profiler::instance().name(nfa, nfa_str);
+            clock.lap("load");
+            ofstream out{argv[argc - 1]};
             if (!out.is_open())
                 throw runtime_error("cannot open output file");
 
-            auto freq = compute_freq(nfa, pcap, aflag, cnt);
+            if (flow_mem && (lazy_dfa_mem || nmatchers || nworkers > 1))
+                throw runtime_error("-s cannot be combined with -l, -p or -n");
+            if (rules && (flow_mem || lazy_dfa_mem || nmatchers ||
+                nworkers > 1))
+                throw runtime_error(
+                    "-m cannot be combined with -l, -n, -p or -s");
+
+            if ((per_flow || tol > 0) && rate == 0)
+                rate = 1;
+            if (rate && (rules || flow_mem || lazy_dfa_mem || nmatchers ||
+                cnt != ~0UL))
+            {
+                throw runtime_error(
+                    "sampling cannot be combined with -m, -s, -l, -p or -c");
+            }
+            if (rate < 0 || rate > 1 || tol < 0 || tol > 1)
+                throw runtime_error("invalid sampling rate or tolerance");
+            for (auto &i : pcaps) {
+                if ((rate || flow_mem) &&
+                    pcapreader::PayloadCorpus::is_corpus(i.c_str()))
+                {
+                    throw runtime_error(
+                        "corpus has no flow information, it cannot be used "
+                        "with -S, -f, -e or -s");
+                }
+                // packets of a corpus are not stored in their order
+                if (cnt != ~0UL &&
+                    pcapreader::PayloadCorpus::is_corpus(i.c_str()))
+                {
+                    throw runtime_error("-c cannot be used with a corpus");
+                }
+            }
 
-            for (auto i : freq)
-                out << i.first << " " << i.second << endl;
+            if (rate) {
+                auto freq = compute_freq_sample(
+                    nfa, pcaps, aflag, rate, per_flow, tol);
+                clock.lap("frequency");
+                for (auto i : freq) {
+                    out << i.first << " " << llround(i.second.freq) << " "
+                        << llround(i.second.low) << " "
+                        << llround(i.second.high) << endl;
+                }
+            }
+            else if (rules) {
+                auto matches = compute_matches(nfa, pcaps, cnt);
+                clock.lap("frequency");
+                for (auto i : matches) {
+                    out << i.first << " " << i.second.first << " "
+                        << i.second.second << endl;
+                }
+            }
+            else {
+                // in the pipeline mode, the reading thread is extra
+                nworkers = nmatchers ? nmatchers :
+                    max(1U, min(nworkers, thread::hardware_concurrency()));
+                auto freq = compute_freq(
+                    nfa, pcaps, aflag, cnt, lazy_dfa_mem, nworkers,
+                    nmatchers > 0, flow_mem);
+                clock.lap("frequency");
+                for (auto i : freq)
+                    out << i.first << " " << i.second << endl;
+            }
             out.close();
+            clock.lap("output");
+
+            if (profile_file != "") {
+                ofstream prof{profile_file};
+                if (!prof.is_open())
+                    throw runtime_error("cannot open profile file");
+                Profiler::instance().write_json(prof);
+                Profiler::instance().print(cerr);
+            }
         }
         else {
-            cerr << "3 arguments required: NFA PCAP OUTPUT\n";
+            cerr << "at least 3 arguments required: NFA PCAP OUTPUT\n";
         }
     }
     catch (exception &e) {